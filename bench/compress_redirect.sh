@@ -0,0 +1,44 @@
+#!/bin/bash
+# Throughput of v3's in-process compressed redirection against a separate
+# gzip stage. Compression runs "filter >z6 out.gz" vs "filter | gzip -6 > out.gz";
+# decompression runs "wc -l <z in.gz" vs "gzip -dc < in.gz | wc -l".
+#
+#   bench/compress_redirect.sh [megabytes]
+
+set -e
+cd "$(dirname "$0")/.."
+SIZE_MB=${1:-100}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+gcc -O2 v3.c -o "$WORK/shell" -lz -pthread
+python3 - "$WORK/input.txt" "$SIZE_MB" <<'PY'
+import random, sys
+random.seed(1)
+path, size = sys.argv[1], int(sys.argv[2]) << 20
+with open(path, "w") as f:
+    written = i = 0
+    while written < size:
+        line = "%d,host%d,%s,status=%d\n" % (i, random.randint(0, 99), "x" * random.randint(0, 60),
+                                             random.choice([200, 404, 500]))
+        f.write(line)
+        written += len(line)
+        i += 1
+PY
+gzip -6 -c "$WORK/input.txt" > "$WORK/input.gz"
+
+run() {
+    local start end
+    start=$(date +%s.%N)
+    printf '%s\n' "$1" | "$WORK/shell" > /dev/null
+    end=$(date +%s.%N)
+    awk -v mb="$SIZE_MB" -v s="$start" -v e="$end" 'BEGIN { printf "%.0f", mb / (e - s) }'
+}
+
+printf "%-12s %14s %14s\n" "direction" "in-process" "gzip stage"
+fast=$(run "grep -F , < $WORK/input.txt >z6 $WORK/out.gz")
+slow=$(run "grep -F , < $WORK/input.txt | gzip -6 > $WORK/out.gz")
+printf "%-12s %9s MB/s %9s MB/s\n" "compress" "$fast" "$slow"
+fast=$(run "wc -l <z $WORK/input.gz")
+slow=$(run "gzip -dc < $WORK/input.gz | wc -l")
+printf "%-12s %9s MB/s %9s MB/s\n" "decompress" "$fast" "$slow"
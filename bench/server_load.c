@@ -0,0 +1,127 @@
+/*
+*  server_load.c: load generator for the v6 shell's --server mode
+*  Sends the same command line to a running server N times over one
+*  connection and reports requests/sec. With a shell binary as the optional
+*  last argument it also times starting a fresh shell for every command,
+*  which is what --server is meant to replace.
+*
+*  gcc -O2 bench/server_load.c -o server_load
+*  ./v6 --server /tmp/shell.sock &
+*  ./server_load /tmp/shell.sock 2000 true ./v6
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+
+#define MSG_SIZE 65536
+
+struct server_reply {
+    int status;
+    struct rusage usage;
+};
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double bench_server(char* sock_path, int requests, char* cmd, int devnull) {
+    extern char** environ;
+    char* msg = malloc(MSG_SIZE);
+    size_t len = 0;
+    getcwd(msg, 4096);
+    len = strlen(msg) + 1;
+    strcpy(msg + len, cmd);
+    len += strlen(cmd) + 1;
+    for (char** e = environ; *e && len + strlen(*e) + 1 < MSG_SIZE; e++) {
+        strcpy(msg + len, *e);
+        len += strlen(*e) + 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("connect failed");
+        exit(1);
+    }
+
+    int fds[3] = {devnull, devnull, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    double start = now();
+    for (int i = 0; i < requests; i++) {
+        memset(control, 0, sizeof(control));
+        struct iovec iov = {msg, len};
+        struct msghdr hdr = {0};
+        hdr.msg_iov = &iov;
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = control;
+        hdr.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        struct server_reply reply;
+        if (sendmsg(fd, &hdr, 0) < 0 || recv(fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+            perror("request failed");
+            exit(1);
+        }
+    }
+    double elapsed = now() - start;
+    close(fd);
+    free(msg);
+    return requests / elapsed;
+}
+
+double bench_fresh_shell(char* shell, int requests, char* cmd, int devnull) {
+    double start = now();
+    for (int i = 0; i < requests; i++) {
+        int in[2];
+        pipe(in);
+        pid_t pid = fork();
+        if (pid == 0) {
+            dup2(in[0], STDIN_FILENO);
+            dup2(devnull, STDOUT_FILENO);
+            close(in[0]);
+            close(in[1]);
+            execl(shell, shell, (char*)NULL);
+            perror("exec failed");
+            exit(1);
+        }
+        close(in[0]);
+        dprintf(in[1], "%s\n", cmd);
+        close(in[1]);
+        waitpid(pid, NULL, 0);
+    }
+    return requests / (now() - start);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <socket> <requests> [command] [shell]\n", argv[0]);
+        return 1;
+    }
+    int requests = atoi(argv[2]);
+    char* cmd = argc > 3 ? argv[3] : "true";
+    int devnull = open("/dev/null", O_RDWR);
+
+    printf("server:      %.0f requests/sec\n", bench_server(argv[1], requests, cmd, devnull));
+    if (argc > 4) {
+        printf("fresh shell: %.0f requests/sec\n", bench_fresh_shell(argv[4], requests, cmd, devnull));
+    }
+    return 0;
+}
@@ -0,0 +1,32 @@
+#!/bin/bash
+# Scaling of v3's sharded pipeline stages ("|[N] cmd") on a CPU-bound filter.
+# Runs "cat input |[N] gzip -6 | wc -c" for increasing N and prints the time
+# and speedup over N=1.
+#
+#   bench/shard_scaling.sh [megabytes] [max_shards]
+
+set -e
+cd "$(dirname "$0")/.."
+SIZE_MB=${1:-256}
+MAX_SHARDS=${2:-$(nproc)}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+gcc -O2 v3.c -o "$WORK/shell"
+seq 1 100000000 | head -c "$((SIZE_MB << 20))" > "$WORK/input.txt"
+
+elapsed() {
+    local start end
+    start=$(date +%s.%N)
+    printf 'cat %s |[%d] gzip -6 | wc -c > /dev/null\n' "$WORK/input.txt" "$1" | "$WORK/shell" > /dev/null
+    end=$(date +%s.%N)
+    awk -v s="$start" -v e="$end" 'BEGIN { printf "%.3f", e - s }'
+}
+
+base=$(elapsed 1)
+printf "%-8s %10s %10s\n" "shards" "seconds" "speedup"
+printf "%-8d %10s %10s\n" 1 "$base" "1.00x"
+for ((n = 2; n <= MAX_SHARDS; n *= 2)); do
+    t=$(elapsed "$n")
+    printf "%-8d %10s %9sx\n" "$n" "$t" "$(awk -v b="$base" -v t="$t" 'BEGIN { printf "%.2f", b / t }')"
+done
@@ -0,0 +1,53 @@
+#!/bin/bash
+# Startup cost of the full and lean (make lean) builds of the unified shell,
+# v3, v5 and v6.
+# Each binary is started RUNS times with stdin at EOF, so the time is what it
+# takes to come up, find no input and exit. Size, linked libraries and the
+# resident set of an idle shell waiting for its first command are shown as a
+# footprint measure. The "+rc" rows start v6 with a 120-line rc file, once
+# restored from its snapshot and once evaluated line by line because no
+# snapshot can be written.
+#
+#   bench/startup.sh [runs]
+
+set -e
+cd "$(dirname "$0")/.."
+RUNS=${1:-500}
+make -s shell v3 v5 v6 lean
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export SHELL_CACHE_DIR=$WORK/cache ELEVENSHELL_RC=$WORK/none
+for ((i = 0; i < 60; i++)); do
+    echo "set VAR$i value$i"
+    echo "alias cmd$i echo $i"
+done > "$WORK/rc"
+
+per_start() {
+    local bin=$1 start end
+    start=$(date +%s.%N)
+    for ((i = 0; i < RUNS; i++)); do
+        "./$bin" < /dev/null > /dev/null
+    done
+    end=$(date +%s.%N)
+    awk -v n="$RUNS" -v s="$start" -v e="$end" 'BEGIN { printf "%.0f", (e - s) * 1e6 / n }'
+}
+
+idle_rss() {
+    python3 -c 'import subprocess, sys, time
+p = subprocess.Popen(["./" + sys.argv[1]], stdin=subprocess.PIPE, stdout=subprocess.DEVNULL)
+time.sleep(0.2)
+print([l.split()[1] for l in open("/proc/%d/status" % p.pid) if l.startswith("VmRSS")][0])
+p.stdin.close()
+p.wait()' "$1"
+}
+
+printf "%-10s %12s %10s %6s %10s\n" "binary" "us/start" "size" "libs" "idle RSS"
+for bin in shell shell-lean v3 v3-lean v5 v5-lean v6 v6-lean; do
+    printf "%-10s %12s %9sK %6s %9sK\n" "$bin" "$(per_start "$bin")" "$(($(stat -c %s "$bin") / 1024))" \
+        "$(ldd "$bin" | wc -l)" "$(idle_rss "$bin")"
+done
+for bin in v6 v6-lean; do
+    printf "%-22s %12s\n" "$bin +rc (snapshot)" "$(ELEVENSHELL_RC=$WORK/rc per_start "$bin")"
+    printf "%-22s %12s\n" "$bin +rc (evaluated)" \
+        "$(ELEVENSHELL_RC=$WORK/rc SHELL_CACHE_DIR=/dev/null/cache per_start "$bin")"
+done
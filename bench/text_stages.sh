@@ -0,0 +1,44 @@
+#!/bin/bash
+# Throughput of v3's in-process text stages against the coreutils binaries.
+# Each filter runs through the shell twice: once with the built-in stage and
+# once with "set +o textstages", which makes the shell exec coreutils instead.
+#
+#   bench/text_stages.sh [megabytes]
+
+set -e
+cd "$(dirname "$0")/.."
+SIZE_MB=${1:-200}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+gcc -O2 v3.c -o "$WORK/shell"
+python3 - "$WORK/input.txt" "$SIZE_MB" <<'PY'
+import random, sys
+random.seed(1)
+path, size = sys.argv[1], int(sys.argv[2]) << 20
+with open(path, "w") as f:
+    written = i = 0
+    while written < size:
+        line = "%d,host%d,%s,status=%d\n" % (i, random.randint(0, 99), "x" * random.randint(0, 60),
+                                             random.choice([200, 404, 500]))
+        f.write(line)
+        written += len(line)
+        i += 1
+PY
+cat "$WORK/input.txt" > /dev/null
+
+run() {
+    local setup=$1 filter=$2
+    local start end
+    start=$(date +%s.%N)
+    printf '%s\ncat %s | %s > %s\n' "$setup" "$WORK/input.txt" "$filter" "$WORK/out" | "$WORK/shell" > /dev/null
+    end=$(date +%s.%N)
+    awk -v mb="$SIZE_MB" -v s="$start" -v e="$end" 'BEGIN { printf "%.0f", mb / (e - s) }'
+}
+
+printf "%-24s %14s %14s\n" "filter" "in-process" "coreutils"
+for filter in "wc -l" "grep -F status=404" "cut -d , -f 2"; do
+    fast=$(run "set -o textstages" "$filter")
+    slow=$(run "set +o textstages" "$filter")
+    printf "%-24s %9s MB/s %9s MB/s\n" "$filter" "$fast" "$slow"
+done
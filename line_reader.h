@@ -0,0 +1,69 @@
+// Line input shared by shell.c, v5 and v6.
+//
+// Include after the readline headers unless NO_READLINE is set. A shell with more to prepare on its first interactive
+// prompt (v5's tab completion) defines INTERACTIVE_SETUP() before including.
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Read a line a byte at a time so commands that read stdin see exactly
+// what follows their own line, as with readline
+static char *read_plain_line(const char *prompt) {
+    size_t len = 0, cap = 128;
+    char *line = malloc(cap);
+    char c;
+    ssize_t n;
+    if (prompt) {
+        fputs(prompt, stdout);
+        fflush(stdout);
+    }
+    while ((n = read(STDIN_FILENO, &c, 1)) > 0 || (n < 0 && errno == EINTR)) {
+        if (n < 0) continue;
+        if (c == '\n') break;
+        if (len + 1 == cap) line = realloc(line, cap *= 2);
+        line[len++] = c;
+    }
+    if (n == 0 && len == 0) {
+        free(line);
+        return NULL;
+    }
+    line[len] = '\0';
+    return line;
+}
+
+// Terminals get readline, set up (with history, unless NO_HISTORY) on the
+// first prompt; pipes and scripts never touch the terminal or history
+static char *read_command_line(const char *prompt) {
+    static int interactive = -1;
+    if (interactive < 0) {
+        interactive = isatty(STDIN_FILENO);
+    }
+#ifndef NO_READLINE
+    if (interactive) {
+        static int readline_ready = 0;
+        if (!readline_ready) {
+#ifndef NO_HISTORY
+            using_history();
+#endif
+#ifdef INTERACTIVE_SETUP
+            INTERACTIVE_SETUP();
+#endif
+            readline_ready = 1;
+        }
+        char *line = readline(prompt);
+#ifndef NO_HISTORY
+        if (line && *line) {
+            add_history(line);
+        }
+#endif
+        return line;
+    }
+#endif
+    return read_plain_line(interactive ? prompt : NULL);
+}
+
+#endif
@@ -0,0 +1,496 @@
+// The unified shell: command execution, < and > redirection, pipelines,
+// background jobs, history and shell variables from v1-v6 in one source file.
+// Each feature except plain execution and redirection can be compiled out:
+//
+//   -DNO_READLINE   read plain lines, no line editing
+//   -DNO_HISTORY    no history list, "history" or "!N" recall
+//   -DNO_JOBS       no "&", "jobs" or "kill"
+//   -DNO_VARS       no "set", "export", "unset", "printvars" or $NAME expansion
+//   -DNO_PIPES      no "|" pipelines
+//
+// The Makefile maps these to READLINE=0, HISTORY=0, JOBS=0, VARS=0 and
+// PIPES=0 and builds "shell" and "shell-lean" from this file.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#ifndef NO_READLINE
+#include <readline/readline.h>
+#include <readline/history.h>
+#endif
+
+#if !defined(NO_READLINE) && !defined(NO_HISTORY)
+#define HAVE_HISTORY
+#define HISTORY_SIZE 100
+#define INTERACTIVE_SETUP() stifle_history(HISTORY_SIZE)
+#endif
+#include "line_reader.h"
+
+#define MAX_LEN 512
+#define MAXARGS 64
+#define MAX_STAGES 16
+#define MAX_VARS 100
+#define MAX_JOBS 32
+#define PROMPT "ELEVENshell:- "
+
+// One command of a pipeline with its redirections
+struct stage {
+    char *argv[MAXARGS + 1];
+    char *input_file;
+    char *output_file;
+};
+
+#ifndef NO_JOBS
+// A background pipeline; pids[i] is 0 once that stage has been reaped
+struct job {
+    pid_t pids[MAX_STAGES];
+    int count;
+    int live;
+    char cmdline[MAX_LEN];
+};
+
+struct job jobs[MAX_JOBS];
+int job_count = 0;
+#endif
+
+#ifndef NO_VARS
+struct var {
+    char *name;
+    char *value;
+    int global;
+};
+
+struct var vars[MAX_VARS];
+int var_count = 0;
+#endif
+
+int last_status = 0;
+
+#ifndef NO_VARS
+// Set variable
+int set_variable(char *name, char *value, int global) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(vars[i].name, name) == 0) {
+            free(vars[i].value);
+            vars[i].value = strdup(value);
+            vars[i].global = global;
+            return 0;
+        }
+    }
+    if (var_count < MAX_VARS) {
+        vars[var_count].name = strdup(name);
+        vars[var_count].value = strdup(value);
+        vars[var_count].global = global;
+        var_count++;
+        return 0;
+    }
+    fprintf(stderr, "Error: variable limit reached\n");
+    return -1;
+}
+
+// Retrieve variable, falling back to the environment
+char *get_variable(char *name) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(vars[i].name, name) == 0) {
+            return vars[i].value;
+        }
+    }
+    return getenv(name);
+}
+
+// Unset variable
+int unset_variable(char *name) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(vars[i].name, name) == 0) {
+            free(vars[i].name);
+            free(vars[i].value);
+            vars[i] = vars[--var_count];
+            return 0;
+        }
+    }
+    return unsetenv(name);
+}
+
+// Print all user-defined variables
+void printvars() {
+    for (int i = 0; i < var_count; i++) {
+        printf("%s=%s\n", vars[i].name, vars[i].value);
+    }
+}
+
+// Export a variable set with "set" into the environment
+int export_variable(char *name) {
+    for (int i = 0; i < var_count; i++) {
+        if (strcmp(vars[i].name, name) == 0) {
+            setenv(vars[i].name, vars[i].value, 1);
+            vars[i].global = 1;
+            return 0;
+        }
+    }
+    fprintf(stderr, "Variable %s not found\n", name);
+    return -1;
+}
+#endif
+
+// Print environment variables
+void printenv_vars() {
+    extern char **environ;
+    for (char **env = environ; *env != 0; env++) {
+        printf("%s\n", *env);
+    }
+}
+
+#ifndef NO_JOBS
+// Collect finished background processes and drop jobs with none left
+void reap_jobs() {
+    int kept = 0;
+    for (int i = 0; i < job_count; i++) {
+        for (int j = 0; j < jobs[i].count; j++) {
+            if (jobs[i].pids[j] > 0 && waitpid(jobs[i].pids[j], NULL, WNOHANG) != 0) {
+                jobs[i].pids[j] = 0;
+                jobs[i].live--;
+            }
+        }
+        if (jobs[i].live > 0) {
+            jobs[kept++] = jobs[i];
+        }
+    }
+    job_count = kept;
+}
+
+// List background jobs
+void list_jobs() {
+    printf("Background jobs:\n");
+    for (int i = 0; i < job_count; i++) {
+        printf("[%d] PID: %d, Command: %s\n", i + 1, jobs[i].pids[0], jobs[i].cmdline);
+    }
+}
+
+// Kill every process of a background job and collect them
+void kill_job(int job_num) {
+    if (job_num < 1 || job_num > job_count) {
+        fprintf(stderr, "Invalid job number\n");
+        return;
+    }
+    struct job *job = &jobs[job_num - 1];
+    kill(-job->pids[0], SIGKILL);
+    for (int j = 0; j < job->count; j++) {
+        if (job->pids[j] > 0) {
+            waitpid(job->pids[j], NULL, 0);
+        }
+    }
+    printf("Job %d killed\n", job_num);
+    jobs[job_num - 1] = jobs[--job_count];
+}
+#endif
+
+#ifdef HAVE_HISTORY
+// List the remembered command lines with the numbers "!N" takes
+void list_history() {
+    HIST_ENTRY **list = history_list();
+    for (int i = 0; list && list[i]; i++) {
+        printf("%5d  %s\n", i + history_base, list[i]->line);
+    }
+}
+#endif
+
+// Split one pipeline stage into arguments and its < / > redirections.
+// Returns -1 (after reporting why) if the stage cannot run.
+int parse_stage(char *text, struct stage *stage) {
+    int argc = 0;
+    char *save;
+    stage->input_file = NULL;
+    stage->output_file = NULL;
+    for (char *token = strtok_r(text, " \t\n", &save); token; token = strtok_r(NULL, " \t\n", &save)) {
+        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0) {
+            char *file = strtok_r(NULL, " \t\n", &save);
+            if (!file) {
+                fprintf(stderr, "Error: missing file name after %s\n", token);
+                return -1;
+            }
+            if (token[0] == '<') {
+                stage->input_file = file;
+            } else {
+                stage->output_file = file;
+            }
+            continue;
+        }
+#ifndef NO_VARS
+        // $NAME is replaced by the variable's value; an unset one drops the word
+        if (token[0] == '$' && token[1] != '\0' && (token = get_variable(token + 1)) == NULL) {
+            continue;
+        }
+#endif
+        if (argc == MAXARGS) {
+            fprintf(stderr, "Error: too many arguments\n");
+            return -1;
+        }
+        stage->argv[argc++] = token;
+    }
+    stage->argv[argc] = NULL;
+    if (argc == 0) {
+        fprintf(stderr, "Error: empty command\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Apply a stage's file redirections in the child about to exec it
+void redirect_stage(struct stage *stage) {
+    if (stage->input_file) {
+        int fd = open(stage->input_file, O_RDONLY);
+        if (fd < 0) {
+            perror("Input file open failed");
+            exit(1);
+        }
+        dup2(fd, STDIN_FILENO);
+        close(fd);
+    }
+    if (stage->output_file) {
+        int fd = open(stage->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0) {
+            perror("Output file open failed");
+            exit(1);
+        }
+        dup2(fd, STDOUT_FILENO);
+        close(fd);
+    }
+}
+
+// Run a built-in command. Returns 1 if argv named one, 0 otherwise.
+int run_builtin(char **argv) {
+    if (strcmp(argv[0], "cd") == 0) {
+        char *dir = argv[1] ? argv[1] : getenv("HOME");
+        if (!dir || chdir(dir) < 0) {
+            perror("cd failed");
+            last_status = 1;
+        }
+    } else if (strcmp(argv[0], "exit") == 0) {
+        exit(argv[1] ? atoi(argv[1]) : last_status);
+    } else if (strcmp(argv[0], "help") == 0) {
+        printf("Available commands:\ncd, exit, "
+#ifdef HAVE_HISTORY
+               "history, "
+#endif
+#ifndef NO_JOBS
+               "jobs, kill, "
+#endif
+#ifndef NO_VARS
+               "set, export, unset, printvars, "
+#endif
+               "printenv\n");
+    } else if (strcmp(argv[0], "printenv") == 0) {
+        printenv_vars();
+#ifdef HAVE_HISTORY
+    } else if (strcmp(argv[0], "history") == 0) {
+        list_history();
+#endif
+#ifndef NO_JOBS
+    } else if (strcmp(argv[0], "jobs") == 0) {
+        list_jobs();
+    } else if (strcmp(argv[0], "kill") == 0) {
+        if (!argv[1]) {
+            fprintf(stderr, "Usage: kill <job number>\n");
+        } else {
+            kill_job(atoi(argv[1]));
+        }
+#endif
+#ifndef NO_VARS
+    } else if (strcmp(argv[0], "set") == 0) {
+        if (!argv[1] || !argv[2]) {
+            fprintf(stderr, "Usage: set <name> <value>\n");
+            last_status = 1;
+        } else {
+            last_status = set_variable(argv[1], argv[2], 0) < 0;
+        }
+    } else if (strcmp(argv[0], "export") == 0) {
+        last_status = argv[1] ? export_variable(argv[1]) < 0 : 1;
+    } else if (strcmp(argv[0], "unset") == 0) {
+        last_status = argv[1] ? unset_variable(argv[1]) < 0 : 1;
+    } else if (strcmp(argv[0], "printvars") == 0) {
+        printvars();
+#endif
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// Start every stage of a pipeline, connected by pipes, and wait for all of
+// them unless it runs in the background. Pipes are close-on-exec, so each
+// child keeps only the ends dup2() gave it and a writer sees EPIPE once its
+// reader exits.
+void run_pipeline(struct stage *stages, int count, int background, char *cmdline) {
+    pid_t pids[MAX_STAGES];
+    int started = 0;
+    int in_fd = -1;
+    for (int i = 0; i < count; i++) {
+        int fd[2] = {-1, -1};
+        if (i < count - 1 && pipe2(fd, O_CLOEXEC) < 0) {
+            perror("pipe failed");
+            break;
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("Fork failed");
+            if (fd[0] >= 0) {
+                close(fd[0]);
+                close(fd[1]);
+            }
+            break;
+        } else if (pid == 0) {
+#ifndef NO_JOBS
+            // A background job gets its own process group, away from Ctrl-C
+            if (background) {
+                setpgid(0, started ? pids[0] : 0);
+            }
+#endif
+            if (in_fd >= 0) {
+                dup2(in_fd, STDIN_FILENO);
+            }
+            if (fd[1] >= 0) {
+                dup2(fd[1], STDOUT_FILENO);
+            }
+            redirect_stage(&stages[i]);
+            execvp(stages[i].argv[0], stages[i].argv);
+            perror("Command execution failed");
+            exit(127);
+        }
+#ifndef NO_JOBS
+        if (background) {
+            setpgid(pid, started ? pids[0] : pid);
+        }
+#endif
+        pids[started++] = pid;
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (fd[1] >= 0) {
+            close(fd[1]);
+        }
+        in_fd = fd[0];
+    }
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+
+#ifndef NO_JOBS
+    if (background && started > 0) {
+        struct job *job = &jobs[job_count++];
+        memcpy(job->pids, pids, sizeof(pid_t) * started);
+        job->count = job->live = started;
+        snprintf(job->cmdline, sizeof(job->cmdline), "%s", cmdline);
+        printf("[%d] %d\n", job_count, pids[0]);
+        return;
+    }
+#endif
+    for (int i = 0; i < started; i++) {
+        int status;
+        while (waitpid(pids[i], &status, 0) < 0 && errno == EINTR) {
+        }
+        if (i == started - 1) {
+            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        }
+    }
+    if (started < count) {
+        last_status = 1;
+    }
+}
+
+// Parse a command line into pipeline stages and run it
+void execute_line(char *cmdline) {
+    char copy[MAX_LEN * 2];
+    snprintf(copy, sizeof(copy), "%s", cmdline);
+
+    int background = 0;
+    size_t len = strlen(cmdline);
+    while (len > 0 && (cmdline[len - 1] == ' ' || cmdline[len - 1] == '\t')) {
+        cmdline[--len] = '\0';
+    }
+    if (len > 0 && cmdline[len - 1] == '&') {
+        cmdline[--len] = '\0';
+#ifdef NO_JOBS
+        fprintf(stderr, "Error: background jobs not built in\n");
+        last_status = 1;
+        return;
+#else
+        background = 1;
+        reap_jobs();
+        if (job_count == MAX_JOBS) {
+            fprintf(stderr, "Error: too many background jobs\n");
+            last_status = 1;
+            return;
+        }
+#endif
+    }
+
+    struct stage stages[MAX_STAGES];
+    int count = 0;
+#ifdef NO_PIPES
+    if (strchr(cmdline, '|')) {
+        fprintf(stderr, "Error: pipes not built in\n");
+        last_status = 1;
+        return;
+    }
+    if (parse_stage(cmdline, &stages[count++]) < 0) {
+        last_status = 1;
+        return;
+    }
+#else
+    char *save;
+    for (char *text = strtok_r(cmdline, "|", &save); text; text = strtok_r(NULL, "|", &save)) {
+        if (count == MAX_STAGES) {
+            fprintf(stderr, "Error: too many pipeline stages\n");
+            last_status = 1;
+            return;
+        }
+        if (parse_stage(text, &stages[count++]) < 0) {
+            last_status = 1;
+            return;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+#endif
+
+    if (count == 1 && !background && !stages[0].input_file && !stages[0].output_file &&
+        run_builtin(stages[0].argv)) {
+        return;
+    }
+    run_pipeline(stages, count, background, copy);
+}
+
+int main() {
+    char *cmdline;
+    while ((cmdline = read_command_line(PROMPT)) != NULL) {
+#ifndef NO_JOBS
+        reap_jobs();
+#endif
+#ifdef HAVE_HISTORY
+        if (cmdline[0] == '!') {
+            // Handle history recall (!number)
+            HIST_ENTRY *entry = history_get(atoi(cmdline + 1));
+            if (!entry) {
+                printf("No such history entry: %s\n", cmdline);
+                free(cmdline);
+                continue;
+            }
+            free(cmdline);
+            cmdline = strdup(entry->line);
+            printf("Executing from history: %s\n", cmdline);
+        }
+#endif
+        if (strlen(cmdline) > 0) {
+            execute_line(cmdline);
+        }
+        free(cmdline);
+    }
+    return last_status;
+}
@@ -0,0 +1,59 @@
+#!/bin/bash
+# The unified shell runs commands, redirections and pipelines, and each
+# feature compiled out with a switch is refused instead of half-working.
+# Which features the build has is read from its "help" output.
+#
+#   tests/shell_features.sh [shell]
+
+SHELL_BIN=${1:-./shell}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+run() {
+    printf '%s\nexit\n' "$1" | "$SHELL_BIN" 2>&1
+}
+
+help=$(run help)
+
+[ "$(run 'echo hello')" = "hello" ] || fail "simple command"
+run "echo redirected > $WORK/out" > /dev/null
+[ "$(cat "$WORK/out")" = "redirected" ] || fail "output redirection"
+[ "$(run "tr a-z A-Z < $WORK/out")" = "REDIRECTED" ] || fail "input redirection"
+printf 'false\n' | "$SHELL_BIN" > /dev/null 2>&1 && fail "exit status of the last command"
+
+if grep -q printvars <<< "$help"; then
+    [ "$(printf 'set A one\nset B $A\necho $B $MISSING x\nexit\n' | "$SHELL_BIN" 2>&1)" = "one x" ] \
+        || fail "variable expansion"
+    [ "$(printf 'set C two\nexport C\nprintenv\nexit\n' | "$SHELL_BIN" 2>&1 | grep -x C=two)" = "C=two" ] \
+        || fail "export"
+else
+    [ "$(run 'echo $HOME')" = '$HOME' ] || fail "words expanded without variables"
+fi
+
+out=$(run 'seq 1 100000 | grep 7 | sort -n | tail -1')
+if [ "$out" != "99997" ]; then
+    grep -q "pipes not built in" <<< "$out" || fail "pipeline: $out"
+else
+    # A reader that exits early must not leave the writer blocked
+    out=$(timeout 10 bash -c "printf 'yes | head -2\nexit\n' | '$SHELL_BIN' 2>&1")
+    [ "$out" = "$(printf 'y\ny')" ] || fail "pipeline with an early reader exit"
+fi
+
+out=$(printf 'sleep 5 &\njobs\nkill 1\njobs\nexit\n' | timeout 10 "$SHELL_BIN" 2>&1)
+if grep -q "jobs" <<< "$help"; then
+    [ "$(grep -c 'Command: sleep 5' <<< "$out")" = 1 ] || fail "jobs: $out"
+    grep -q "Job 1 killed" <<< "$out" || fail "kill: $out"
+    start=$(date +%s%N)
+    printf 'sleep 3 &\nsleep 0.2\nexit\n' | "$SHELL_BIN" > /dev/null 2>&1
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    [ "$ms" -lt 2000 ] || fail "foreground command waited ${ms}ms for a background job"
+else
+    grep -q "background jobs not built in" <<< "$out" || fail "& without jobs: $out"
+fi
+
+echo "PASS: shell features ($SHELL_BIN)"
@@ -0,0 +1,29 @@
+#!/bin/bash
+# A stage whose reader exits early must get EPIPE/SIGPIPE and end, so
+# "producer | head" returns instead of waiting forever.
+#
+#   tests/v3_pipeline_head.sh [shell]
+
+SHELL_BIN=${1:-./v3}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+seq 1 100000 | gzip > "$WORK/s.gz"
+
+check() {
+    local cmd=$1 expect=$2 out
+    out=$(echo "$cmd" | timeout 10 "$SHELL_BIN" 2>&1)
+    if [ $? -eq 124 ]; then
+        echo "FAIL: hung: $cmd"
+        exit 1
+    fi
+    if [[ "$out" != *"$expect"* ]]; then
+        echo "FAIL: $cmd gave: $out"
+        exit 1
+    fi
+}
+
+check "seq 1 100000000 | head -1" "1"
+check "seq 1 100000000 | grep -F 7 | head -2" "17"
+check "seq 1 100000000 |[2] cat | head -1" "1"
+check "grep -F 99 <z $WORK/s.gz | head -3" "299"
+echo "PASS: v3 pipeline head"
@@ -0,0 +1,25 @@
+#!/bin/bash
+# A line longer than a shard chunk (4 MB) that arrives through a pipe is
+# read until its newline and passed on whole, in every shard mode.
+#
+#   tests/v3_shard_long_line.sh [shell]
+
+SHELL_BIN=${1:-./v3}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+{ seq 1 1000; head -c 5000000 /dev/zero | tr '\0' x; echo; seq 1 1000; } > "$WORK/long"
+expect=$(wc -c < "$WORK/long")
+
+for mode in '[2]' '[2:u]' '[2:k1]'; do
+    cmd="cat $WORK/long | tr a b |$mode tr c d | wc -c"
+    out=$(echo "$cmd" | timeout 20 "$SHELL_BIN" 2>&1)
+    if [ $? -eq 124 ]; then
+        echo "FAIL: hung: $cmd"
+        exit 1
+    fi
+    if [[ "$out" != *"$expect"* ]]; then
+        echo "FAIL: $cmd gave: $out (expected $expect bytes)"
+        exit 1
+    fi
+done
+echo "PASS: v3 shard long line"
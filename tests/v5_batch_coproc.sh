@@ -0,0 +1,23 @@
+#!/bin/bash
+# batch only waits for its own children: a coproc that exits while a batch
+# runs is still noticed and restarted with -r.
+#
+#   tests/v5_batch_coproc.sh [shell]
+
+SHELL_BIN=$(realpath "${1:-./v5}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export SHELL_CACHE_DIR=$WORK/cache
+cd "$WORK" || exit 1
+printf '#!/bin/sh\nread x; echo got $x\nsleep 0.1\n' > once.sh
+printf '#!/bin/sh\nsleep 0.3\n' > slow.sh
+chmod +x once.sh slow.sh
+
+out=$(printf 'coproc -r c ./once.sh\ncoproc write c one\ncoproc read c\nbatch -P 2 ./slow.sh -- a b c d\ncoproc write c two\ncoproc read c\nexit\n' |
+    "$SHELL_BIN" 2>&1)
+if ! grep -qx 'got two' <<< "$out"; then
+    echo "FAIL: coproc was not restarted after exiting during batch"
+    echo "$out"
+    exit 1
+fi
+echo "PASS: v5 batch coproc"
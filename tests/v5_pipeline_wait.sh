@@ -0,0 +1,27 @@
+#!/bin/bash
+# A two-stage pipeline waits for its own stages only, never for a
+# background job that happens to be running.
+#
+#   tests/v5_pipeline_wait.sh [shell]
+
+SHELL_BIN=${1:-./v5}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export SHELL_CACHE_DIR=$WORK/cache
+
+for i in $(seq 1 10); do
+    start=$(date +%s%N)
+    printf 'sleep 3 &\nsleep 0.2 | sleep 0.2\nexit\n' | "$SHELL_BIN" > /dev/null 2>&1
+    ms=$(( ($(date +%s%N) - start) / 1000000 ))
+    if [ "$ms" -ge 2000 ]; then
+        echo "FAIL: pipeline waited ${ms}ms for a background job"
+        exit 1
+    fi
+done
+
+out=$(printf 'echo a b | tr a-z A-Z\nexit\n' | "$SHELL_BIN" 2>&1 | grep -x 'A B')
+if [ "$out" != "A B" ]; then
+    echo "FAIL: pipeline output missing"
+    exit 1
+fi
+echo "PASS: v5 pipeline wait"
@@ -0,0 +1,36 @@
+#!/bin/bash
+# The PATH cache saved in the rc snapshot is dropped once a PATH directory
+# changes, so a command added earlier in PATH is not shadowed by a stale hit.
+#
+#   tests/v6_path_cache.sh [shell]
+
+SHELL_BIN=$(realpath "${1:-./v6}")
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+mkdir "$WORK/d1" "$WORK/d2"
+echo 'set A 1' > "$WORK/rc"
+export ELEVENSHELL_RC=$WORK/rc SHELL_CACHE_DIR=$WORK/cache PATH=$WORK/d2:$WORK/d1:$PATH
+
+tool() {
+    printf '#!/bin/sh\necho %s\n' "$2" > "$1/mytool"
+    chmod +x "$1/mytool"
+}
+run() {
+    echo mytool | "$SHELL_BIN" 2>&1
+}
+
+tool "$WORK/d1" d1
+run > /dev/null
+out=$(run)
+if [ "$out" != "d1" ]; then
+    echo "FAIL: expected d1, got: $out"
+    exit 1
+fi
+sleep 0.05
+tool "$WORK/d2" d2
+out=$(run)
+if [ "$out" != "d2" ]; then
+    echo "FAIL: cached d1 shadowed the new d2 command, got: $out"
+    exit 1
+fi
+echo "PASS: v6 path cache"
@@ -0,0 +1,36 @@
+#!/bin/bash
+# $(...) output is substituted as literal text: a "$(" inside captured
+# output must not be run as another command substitution.
+#
+#   tests/v6_substitution.sh [shell]
+
+SHELL_BIN=${1:-./v6}
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+export ELEVENSHELL_RC=$WORK/none SHELL_CACHE_DIR=$WORK/cache
+
+echo "hello \$(touch $WORK/PWNED)" > "$WORK/f"
+out=$(printf 'echo $(cat %s)\n' "$WORK/f" | "$SHELL_BIN")
+if [ -e "$WORK/PWNED" ]; then
+    echo "FAIL: substituted output was executed"
+    exit 1
+fi
+if [ "$out" != "hello \$(touch $WORK/PWNED)" ]; then
+    echo "FAIL: expected literal output, got: $out"
+    exit 1
+fi
+
+out=$(printf 'echo a $(echo b $(echo c)) d\n' | "$SHELL_BIN")
+if [ "$out" != "a b c d" ]; then
+    echo "FAIL: nested substitution gave: $out"
+    exit 1
+fi
+# Output that cannot be buffered aborts the command instead of running it
+# with a truncated or missing substitution
+out=$( (ulimit -v 200000; printf 'echo $(head -c 300000000 /dev/zero | tr "\\0" a) ran\necho next\n' |
+    "$SHELL_BIN") 2>/dev/null)
+if [ "$out" != "next" ]; then
+    echo "FAIL: command ran after a failed substitution: ${out:0:40}"
+    exit 1
+fi
+echo "PASS: v6 substitution"
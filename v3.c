@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -6,16 +7,52 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#ifndef NO_COMPRESS
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define MAX_LEN 512
 #define MAXARGS 10
 #define ARGLEN 30
 #define PROMPT "ELEVENshell:- "
+#define TEXT_BUF_SIZE (1 << 20)
+#define SHARD_CHUNK_SIZE (4 << 20)
+#define MAX_SHARDS 64
+#define ZIP_BUF_SIZE (256 << 10)
+
+typedef struct {
+    char** argv;
+    int argc;
+    char* input_file;
+    char* output_file;
+    int shards;          // > 0 when the stage was written as "|[N] cmd"
+    int shard_key;       // whitespace field to hash lines on, 0 for chunk round-robin
+    int shard_unordered; // emit chunk outputs as they finish rather than in input order
+    int zip_output;      // ">z file" / ">zN file": compress stdout into the file on a helper thread
+    int zip_level;       // N from ">zN", -1 for the codec's default level
+    int unzip_input;     // "<z file": decompress the file into stdin on a helper thread
+} Stage;
+
+int explain_mode = 0;
+int text_stages_enabled = 1;
 
 int process_command(char* cmdline);
 char** tokenize(char* cmdline);
 char* read_cmd(char* prompt, FILE* fp);
 void handle_sigchld(int sig);
+void select_text_kernels();
+void wait_zip_jobs();
 
 int main() {
     char *cmdline;
@@ -26,11 +63,13 @@ int main() {
     sa.sa_handler = &handle_sigchld;
     sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
     sigaction(SIGCHLD, &sa, NULL);
+    select_text_kernels();
 
     while((cmdline = read_cmd(prompt, stdin)) != NULL) {
         process_command(cmdline);
         free(cmdline);
     }
+    wait_zip_jobs();
     printf("\n");
     return 0;
 }
@@ -40,14 +79,1134 @@ void handle_sigchld(int sig) {
     while (waitpid(-1, NULL, WNOHANG) > 0);
 }
 
+// ---- In-process text stages: wc -l, grep -F <pattern>, cut -d <c> -f <n> ----
+
+size_t count_newlines_scalar(const char* buf, size_t len) {
+    size_t count = 0;
+    const char* end = buf + len;
+    while ((buf = memchr(buf, '\n', end - buf)) != NULL) {
+        count++;
+        buf++;
+    }
+    return count;
+}
+
+const char* find_fixed_scalar(const char* hay, size_t n, const char* needle, size_t k) {
+    return memmem(hay, n, needle, k);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// Matches are accumulated as per-byte counters (cmpeq yields -1) for up to
+// 255 blocks, then folded into 64-bit lanes with sad_epu8
+__attribute__((target("avx2")))
+size_t count_newlines_avx2(const char* buf, size_t len) {
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    while (i + 32 <= len) {
+        __m256i counters = _mm256_setzero_si256();
+        for (int blocks = 0; blocks < 255 && i + 32 <= len; blocks++, i += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i*)(buf + i));
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(block, nl));
+        }
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(counters, zero));
+    }
+    size_t count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1) +
+                   _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return count + count_newlines_scalar(buf + i, len - i);
+}
+
+// Compare the first and last needle byte at 32 positions at once and only
+// memcmp the candidates where both agree
+__attribute__((target("avx2,bmi")))
+const char* find_fixed_avx2(const char* hay, size_t n, const char* needle, size_t k) {
+    if (k == 0 || n < k) {
+        return k == 0 ? hay : NULL;
+    }
+    const __m256i first = _mm256_set1_epi8(needle[0]);
+    const __m256i last = _mm256_set1_epi8(needle[k - 1]);
+    size_t i = 0;
+    for (; i + k - 1 + 32 <= n; i += 32) {
+        __m256i block_first = _mm256_loadu_si256((const __m256i*)(hay + i));
+        __m256i block_last = _mm256_loadu_si256((const __m256i*)(hay + i + k - 1));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                              _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            const char* candidate = hay + i + __builtin_ctz(mask);
+            if (memcmp(candidate, needle, k) == 0) {
+                return candidate;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return memmem(hay + i, n - i, needle, k);
+}
+
+// pcmpestri finds full matches and partial matches running off the end of
+// the 16-byte block; a partial match restarts the scan at its position
+__attribute__((target("sse4.2")))
+const char* find_fixed_sse42(const char* hay, size_t n, const char* needle, size_t k) {
+    if (k == 0 || k > 16) {
+        return memmem(hay, n, needle, k);
+    }
+    char padded[16] = {0};
+    memcpy(padded, needle, k);
+    const __m128i pattern = _mm_loadu_si128((const __m128i*)padded);
+    size_t i = 0;
+    while (i + 16 <= n) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(hay + i));
+        int idx = _mm_cmpestri(pattern, k, block, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ORDERED);
+        if (idx == 16) {
+            i += 16;
+        } else if (idx + k <= 16) {
+            return hay + i + idx;
+        } else {
+            i += idx;
+        }
+    }
+    return memmem(hay + i, n - i, needle, k);
+}
+#endif
+
+size_t (*count_newlines)(const char*, size_t) = count_newlines_scalar;
+const char* (*find_fixed)(const char*, size_t, const char*, size_t) = find_fixed_scalar;
+
+// Pick the widest kernels this CPU supports
+void select_text_kernels() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi")) {
+        count_newlines = count_newlines_avx2;
+        find_fixed = find_fixed_avx2;
+    } else if (__builtin_cpu_supports("sse4.2")) {
+        find_fixed = find_fixed_sse42;
+    }
+#endif
+}
+
+typedef enum { TEXT_NONE, TEXT_WC_LINES, TEXT_GREP_FIXED, TEXT_CUT_FIELD } TextKind;
+
+typedef struct {
+    TextKind kind;
+    const char* pattern;
+    size_t pattern_len;
+    char delim;
+    int field;
+    int matched;
+} TextStage;
+
+// Recognise the exact argument forms the in-process stages implement
+TextKind classify_text_stage(Stage* stage, TextStage* text) {
+    char** argv = stage->argv;
+    memset(text, 0, sizeof(*text));
+    if (!text_stages_enabled) {
+        return TEXT_NONE;
+    }
+    if (stage->argc == 2 && strcmp(argv[0], "wc") == 0 && strcmp(argv[1], "-l") == 0) {
+        text->kind = TEXT_WC_LINES;
+    } else if (stage->argc == 3 && strcmp(argv[0], "grep") == 0 && strcmp(argv[1], "-F") == 0 && argv[2][0]) {
+        text->kind = TEXT_GREP_FIXED;
+        text->pattern = argv[2];
+        text->pattern_len = strlen(argv[2]);
+    } else if (strcmp(argv[0], "cut") == 0 && (stage->argc == 3 || stage->argc == 5)) {
+        const char* d = NULL;
+        const char* f = NULL;
+        for (int i = 1; i < stage->argc; i++) {
+            const char** target = strncmp(argv[i], "-d", 2) == 0 ? &d : strncmp(argv[i], "-f", 2) == 0 ? &f : NULL;
+            if (target == NULL) {
+                return TEXT_NONE;
+            }
+            if (argv[i][2] != '\0') {
+                *target = argv[i] + 2;
+            } else if (stage->argc == 5 && i + 1 < stage->argc) {
+                *target = argv[++i];
+            } else {
+                return TEXT_NONE;
+            }
+        }
+        if (d == NULL || f == NULL || strlen(d) != 1 || strspn(f, "0123456789") != strlen(f) || atoi(f) < 1) {
+            return TEXT_NONE;
+        }
+        text->kind = TEXT_CUT_FIELD;
+        text->delim = d[0];
+        text->field = atoi(f);
+    }
+    return text->kind;
+}
+
+void emit_line(const char* line, size_t len) {
+    fwrite(line, 1, len, stdout);
+    if (len == 0 || line[len - 1] != '\n') {
+        putchar('\n');
+    }
+}
+
+// Process whole lines in buf[0, len); the last line may lack its newline at EOF
+void process_text_lines(TextStage* text, const char* buf, size_t len) {
+    const char* end = buf + len;
+    if (text->kind == TEXT_GREP_FIXED) {
+        const char* pos = buf;
+        const char* hit;
+        while (pos < end && (hit = find_fixed(pos, end - pos, text->pattern, text->pattern_len)) != NULL) {
+            const char* line = memrchr(pos, '\n', hit - pos);
+            line = line ? line + 1 : pos;
+            const char* line_end = memchr(hit, '\n', end - hit);
+            line_end = line_end ? line_end + 1 : end;
+            emit_line(line, line_end - line);
+            text->matched = 1;
+            pos = line_end;
+        }
+    } else if (text->kind == TEXT_CUT_FIELD) {
+        for (const char* line = buf; line < end;) {
+            const char* line_end = memchr(line, '\n', end - line);
+            line_end = line_end ? line_end : end;
+            const char* field = line;
+            const char* delim = memchr(line, text->delim, line_end - line);
+            if (delim == NULL) {
+                emit_line(line, line_end - line);
+            } else {
+                for (int i = 1; i < text->field && field != NULL; i++) {
+                    const char* next = memchr(field, text->delim, line_end - field);
+                    field = next ? next + 1 : NULL;
+                }
+                if (field == NULL) {
+                    field = line_end;
+                }
+                const char* field_end = memchr(field, text->delim, line_end - field);
+                emit_line(field, (field_end ? field_end : line_end) - field);
+            }
+            line = line_end + 1;
+        }
+    }
+}
+
+// Run a recognised text stage on stdin/stdout and return its exit status
+int run_text_stage(TextStage* text) {
+    size_t cap = TEXT_BUF_SIZE;
+    size_t carry = 0;
+    size_t lines = 0;
+    char* buf = malloc(cap);
+    static char out_buf[TEXT_BUF_SIZE];
+    setvbuf(stdout, out_buf, _IOFBF, sizeof(out_buf));
+
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, buf + carry, cap - carry);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        int eof = n <= 0;
+        size_t len = carry + (eof ? 0 : n);
+
+        if (text->kind == TEXT_WC_LINES) {
+            lines += count_newlines(buf, len);
+            carry = 0;
+        } else {
+            size_t complete = len;
+            if (!eof) {
+                const char* last_nl = memrchr(buf, '\n', len);
+                if (last_nl == NULL) {
+                    if (len == cap) {
+                        cap *= 2;
+                        buf = realloc(buf, cap);
+                    }
+                    carry = len;
+                    continue;
+                }
+                complete = last_nl + 1 - buf;
+            }
+            process_text_lines(text, buf, complete);
+            memmove(buf, buf + complete, len - complete);
+            carry = len - complete;
+        }
+        if (eof) {
+            break;
+        }
+    }
+
+    if (text->kind == TEXT_WC_LINES) {
+        printf("%zu\n", lines);
+    }
+    fflush(stdout);
+    free(buf);
+    return text->kind == TEXT_GREP_FIXED && !text->matched ? 1 : 0;
+}
+
+// Replace the current (child) process with the stage's command
+void exec_stage(Stage* stage) {
+    // Simple text filters run right here instead of exec'ing coreutils
+    TextStage text;
+    if (classify_text_stage(stage, &text) != TEXT_NONE) {
+        exit(run_text_stage(&text));
+    }
+    execvp(stage->argv[0], stage->argv);
+    perror("exec failed");
+    exit(1);
+}
+
+// ---- Sharded stages: "producer |[N] filter | consumer" ----
+//
+// The stage process becomes a coordinator. By default it cuts its input into
+// SHARD_CHUNK_SIZE chunks on line boundaries, runs one copy of the filter per
+// chunk with at most N alive, and writes their outputs back in input order
+// (":u" writes each as soon as it finishes). With ":kF" it starts N long-lived
+// copies and routes every line by a hash of its whitespace field F; output is
+// then passed through a line at a time as it arrives.
+
+typedef struct {
+    pid_t pid;
+    int in_fd;
+    int out_fd;
+    char* pending;
+    size_t pending_len;
+    size_t pending_off;
+    size_t pending_cap;
+    char* out;
+    size_t out_len;
+    size_t out_cap;
+    long seq;
+    int active;
+} ShardWorker;
+
+// Parse "[N]", "[N:u]" or "[N:kF]" at the start of a pipeline segment
+char* parse_shard_spec(char* text, Stage* stage) {
+    char* p = text + strspn(text, " \t");
+    if (*p != '[') {
+        return text;
+    }
+    char* end;
+    int shards = strtol(p + 1, &end, 10);
+    int key = 0, unordered = 0;
+    while (*end == ':') {
+        if (end[1] == 'u') {
+            unordered = 1;
+            end += 2;
+        } else if (end[1] == 'k') {
+            key = strtol(end + 2, &end, 10);
+        } else {
+            break;
+        }
+    }
+    if (*end != ']' || shards < 1 || shards > MAX_SHARDS || key < 0) {
+        fprintf(stderr, "Bad shard spec, expected |[N], |[N:u] or |[N:kF] (N <= %d)\n", MAX_SHARDS);
+        return NULL;
+    }
+    stage->shards = shards;
+    stage->shard_key = key;
+    stage->shard_unordered = unordered || key > 0;
+    return end + 1;
+}
+
+void buf_append(char** buf, size_t* len, size_t* cap, const char* data, size_t n) {
+    if (*len + n > *cap) {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+        if (*buf == NULL) {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+int write_all(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t w = write(fd, data, n);
+        if (w < 0 && errno == EINTR) {
+            continue;
+        }
+        if (w <= 0) {
+            return -1;
+        }
+        data += w;
+        n -= w;
+    }
+    return 0;
+}
+
+// Start one copy of the stage's command with pipes on stdin and stdout
+int spawn_shard_worker(Stage* stage, ShardWorker* workers, int count, ShardWorker* worker) {
+    int in[2], out[2];
+    if (pipe(in) < 0) {
+        return -1;
+    }
+    if (pipe(out) < 0) {
+        close(in[0]);
+        close(in[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    } else if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        for (int i = 0; i < count; i++) {
+            if (workers[i].active && workers[i].in_fd >= 0) close(workers[i].in_fd);
+            if (workers[i].active && workers[i].out_fd >= 0) close(workers[i].out_fd);
+        }
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        close(in[0]);
+        close(in[1]);
+        close(out[0]);
+        close(out[1]);
+        exec_stage(stage);
+    }
+    close(in[0]);
+    close(out[1]);
+    fcntl(in[1], F_SETFL, O_NONBLOCK);
+    memset(worker, 0, sizeof(*worker));
+    worker->pid = pid;
+    worker->in_fd = in[1];
+    worker->out_fd = out[0];
+    worker->active = 1;
+    return 0;
+}
+
+unsigned int hash_field(const char* line, size_t len, int field) {
+    const char* p = line;
+    const char* end = line + len;
+    for (int f = 1; p < end; f++) {
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+        const char* start = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\n') p++;
+        if (f == field) {
+            unsigned int h = 2166136261u;
+            for (const char* c = start; c < p; c++) {
+                h = (h ^ (unsigned char)*c) * 16777619u;
+            }
+            return h;
+        }
+    }
+    return 2166136261u;
+}
+
+int has_free_worker(ShardWorker* workers, int n) {
+    for (int i = 0; i < n; i++) {
+        if (!workers[i].active) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Hand a chunk of whole lines to the workers; takes ownership of chunk
+int dispatch_chunk(Stage* stage, ShardWorker* workers, char* chunk, size_t len, long seq) {
+    int n = stage->shards;
+    if (stage->shard_key == 0) {
+        for (int i = 0; i < n; i++) {
+            if (workers[i].active) {
+                continue;
+            }
+            if (spawn_shard_worker(stage, workers, n, &workers[i]) < 0) {
+                perror("shard fork failed");
+                free(chunk);
+                return -1;
+            }
+            workers[i].pending = chunk;
+            workers[i].pending_len = len;
+            workers[i].seq = seq;
+            return 0;
+        }
+        return -1;
+    }
+
+    for (const char* line = chunk; line < chunk + len;) {
+        const char* nl = memchr(line, '\n', chunk + len - line);
+        const char* line_end = nl ? nl + 1 : chunk + len;
+        ShardWorker* w = &workers[hash_field(line, line_end - line, stage->shard_key) % n];
+        if (w->pending_off == w->pending_len) {
+            w->pending_len = w->pending_off = 0;
+        }
+        buf_append(&w->pending, &w->pending_len, &w->pending_cap, line, line_end - line);
+        line = line_end;
+    }
+    free(chunk);
+    return 0;
+}
+
+int run_sharded_stage(Stage* stage) {
+    int n = stage->shards;
+    int hashed = stage->shard_key > 0;
+    ShardWorker workers[MAX_SHARDS];
+    memset(workers, 0, sizeof(workers));
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGCHLD, SIG_DFL);
+
+    if (hashed) {
+        for (int i = 0; i < n; i++) {
+            if (spawn_shard_worker(stage, workers, n, &workers[i]) < 0) {
+                perror("shard fork failed");
+                return 1;
+            }
+        }
+    }
+
+    size_t in_cap = SHARD_CHUNK_SIZE * 2;
+    size_t in_len = 0;
+    char* input = malloc(in_cap);
+    int input_eof = 0;
+    // Leading bytes of input already known to hold no newline
+    size_t no_newline = 0;
+    long next_seq = 0;
+    long emit_seq = 0;
+    int inputs_closed = 0;
+
+    for (;;) {
+        // Cut whole-line chunks off the input while there is somewhere to send them
+        while (in_len > 0 && (in_len >= SHARD_CHUNK_SIZE || input_eof)) {
+            char* nl = input_eof ? input + in_len - 1 : memrchr(input + no_newline, '\n', in_len - no_newline);
+            if (nl == NULL) {
+                no_newline = in_len;
+                break;
+            }
+            if (!hashed && !has_free_worker(workers, n)) {
+                break;
+            }
+            size_t chunk_len = nl + 1 - input;
+            char* rest = malloc(in_cap);
+            memcpy(rest, input + chunk_len, in_len - chunk_len);
+            if (dispatch_chunk(stage, workers, input, chunk_len, next_seq) < 0) {
+                free(rest);
+                return 1;
+            }
+            next_seq++;
+            input = rest;
+            in_len -= chunk_len;
+            no_newline = input_eof ? 0 : in_len;
+        }
+        if (in_len == in_cap) {
+            in_cap *= 2;
+            input = realloc(input, in_cap);
+        }
+
+        size_t backlog = 0;
+        int busy = 0;
+        for (int i = 0; i < n; i++) {
+            if (workers[i].active) {
+                backlog += workers[i].pending_len - workers[i].pending_off;
+                busy++;
+            }
+        }
+        if (hashed && input_eof && in_len == 0 && backlog == 0 && !inputs_closed) {
+            for (int i = 0; i < n; i++) {
+                close(workers[i].in_fd);
+                workers[i].in_fd = -1;
+            }
+            inputs_closed = 1;
+        }
+        if (input_eof && in_len == 0 && busy == 0) {
+            break;
+        }
+
+        struct pollfd pfds[2 * MAX_SHARDS + 1];
+        ShardWorker* owners[2 * MAX_SHARDS + 1];
+        int nfds = 0;
+        // A line longer than a chunk is read until its newline arrives; the
+        // buffer grows for it
+        int want_input = !input_eof && ((in_len < SHARD_CHUNK_SIZE && (!hashed || backlog < SHARD_CHUNK_SIZE)) ||
+                                        (in_len > 0 && no_newline == in_len));
+        if (want_input) {
+            pfds[nfds].fd = STDIN_FILENO;
+            pfds[nfds].events = POLLIN;
+            owners[nfds++] = NULL;
+        }
+        for (int i = 0; i < n; i++) {
+            ShardWorker* w = &workers[i];
+            if (!w->active) {
+                continue;
+            }
+            if (w->in_fd >= 0 && w->pending_off < w->pending_len) {
+                pfds[nfds].fd = w->in_fd;
+                pfds[nfds].events = POLLOUT;
+                owners[nfds++] = w;
+            }
+            if (w->out_fd >= 0) {
+                pfds[nfds].fd = w->out_fd;
+                pfds[nfds].events = POLLIN;
+                owners[nfds++] = w;
+            }
+        }
+        if (nfds == 0) {
+            if (!input_eof || in_len > 0) {
+                fprintf(stderr, "shard: stalled with %zu bytes of input left\n", in_len);
+                return 1;
+            }
+            break;
+        }
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll failed");
+            return 1;
+        }
+
+        for (int j = 0; j < nfds; j++) {
+            ShardWorker* w = owners[j];
+            if (pfds[j].revents == 0) {
+                continue;
+            }
+            if (w == NULL) {
+                ssize_t r = read(STDIN_FILENO, input + in_len, in_cap - in_len);
+                if (r > 0) {
+                    in_len += r;
+                } else if (r == 0 || errno != EINTR) {
+                    input_eof = 1;
+                }
+            } else if (pfds[j].fd == w->in_fd) {
+                ssize_t r = write(w->in_fd, w->pending + w->pending_off, w->pending_len - w->pending_off);
+                if (r > 0) {
+                    w->pending_off += r;
+                } else if (r < 0 && errno != EAGAIN && errno != EINTR) {
+                    w->pending_off = w->pending_len;
+                }
+                if (!hashed && w->pending_off == w->pending_len) {
+                    close(w->in_fd);
+                    w->in_fd = -1;
+                    free(w->pending);
+                    w->pending = NULL;
+                }
+            } else {
+                char buf[65536];
+                ssize_t r = read(w->out_fd, buf, sizeof(buf));
+                if (r > 0) {
+                    buf_append(&w->out, &w->out_len, &w->out_cap, buf, r);
+                    if (hashed) {
+                        char* nl = memrchr(w->out, '\n', w->out_len);
+                        if (nl != NULL) {
+                            size_t done = nl + 1 - w->out;
+                            write_all(STDOUT_FILENO, w->out, done);
+                            memmove(w->out, w->out + done, w->out_len - done);
+                            w->out_len -= done;
+                        }
+                    }
+                } else if (r == 0 || errno != EINTR) {
+                    close(w->out_fd);
+                    w->out_fd = -1;
+                    waitpid(w->pid, NULL, 0);
+                    if (w->in_fd >= 0) {
+                        close(w->in_fd);
+                        w->in_fd = -1;
+                    }
+                    if (hashed || stage->shard_unordered) {
+                        write_all(STDOUT_FILENO, w->out, w->out_len);
+                        w->out_len = 0;
+                    }
+                }
+            }
+        }
+
+        // Release finished workers, in input order unless order does not matter
+        for (int progressed = 1; progressed;) {
+            progressed = 0;
+            for (int i = 0; i < n; i++) {
+                ShardWorker* w = &workers[i];
+                if (!w->active || w->out_fd >= 0 || w->in_fd >= 0) {
+                    continue;
+                }
+                if (!hashed && !stage->shard_unordered) {
+                    if (w->seq != emit_seq) {
+                        continue;
+                    }
+                    write_all(STDOUT_FILENO, w->out, w->out_len);
+                }
+                emit_seq += !hashed && !stage->shard_unordered;
+                free(w->out);
+                free(w->pending);
+                memset(w, 0, sizeof(*w));
+                progressed = 1;
+            }
+        }
+    }
+    free(input);
+    return 0;
+}
+
+// ---- Compressed redirection: "cmd >z out.gz", "cmd >z19 out.zst", "cmd <z in.gz" ----
+//
+// The stage reads or writes a pipe as usual; a helper thread in the shell
+// streams between that pipe and the file through zlib (gzip framing) or, when
+// built with -DHAVE_ZSTD, zstd. Output picks the codec from the ".zst" suffix,
+// input from the file's magic bytes.
+
+#ifndef NO_COMPRESS
+typedef struct {
+    int in_fd;
+    int out_fd;
+    int compress;  // 1: in_fd -> codec -> out_fd, 0: the reverse
+    int zstd;
+    int level;
+    char* path;    // own copy: background threads outlive the stage that named the file
+} ZipJob;
+
+void free_zip_job(ZipJob* job) {
+    free(job->path);
+    free(job);
+}
+
+int zip_active = 0;
+pthread_mutex_t zip_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t zip_done = PTHREAD_COND_INITIALIZER;
+
+// Called before the shell exits so background pipelines still get complete files
+void wait_zip_jobs() {
+    pthread_mutex_lock(&zip_lock);
+    while (zip_active > 0) {
+        pthread_cond_wait(&zip_done, &zip_lock);
+    }
+    pthread_mutex_unlock(&zip_lock);
+}
+
+int read_retry(int fd, unsigned char* buf, size_t size) {
+    ssize_t n;
+    while ((n = read(fd, buf, size)) < 0 && errno == EINTR);
+    return n;
+}
+
+int run_zlib(ZipJob* job, unsigned char* in, unsigned char* out) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    int level = job->level < 0 ? Z_DEFAULT_COMPRESSION : job->level;
+    int rc = job->compress ? deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+                           : inflateInit2(&zs, 15 + 32); // accept gzip or zlib headers
+    if (rc != Z_OK) {
+        return -1;
+    }
+
+    int status = 0, ended = 0;
+    ssize_t n;
+    do {
+        if ((n = read_retry(job->in_fd, in, ZIP_BUF_SIZE)) < 0) {
+            status = -1;
+            break;
+        }
+        zs.next_in = in;
+        zs.avail_in = n;
+        if (job->compress) {
+            do {
+                zs.next_out = out;
+                zs.avail_out = ZIP_BUF_SIZE;
+                deflate(&zs, n == 0 ? Z_FINISH : Z_NO_FLUSH);
+                status = write_all(job->out_fd, (char*)out, ZIP_BUF_SIZE - zs.avail_out);
+            } while (zs.avail_out == 0 && status == 0);
+        } else {
+            while ((zs.avail_in > 0 || zs.avail_out == 0) && status == 0 && n > 0) {
+                zs.next_out = out;
+                zs.avail_out = ZIP_BUF_SIZE;
+                rc = inflate(&zs, Z_NO_FLUSH);
+                if (rc == Z_STREAM_END) {
+                    inflateReset(&zs); // concatenated gzip members
+                    ended = 1;
+                } else if (rc == Z_OK) {
+                    ended = 0;
+                } else if (rc != Z_BUF_ERROR) {
+                    status = -1;
+                    break;
+                }
+                status = write_all(job->out_fd, (char*)out, ZIP_BUF_SIZE - zs.avail_out);
+                if (rc == Z_BUF_ERROR) {
+                    break;
+                }
+            }
+            if (n == 0 && !ended) {
+                status = -1;
+            }
+        }
+    } while (n > 0 && status == 0);
+
+    if (job->compress) {
+        deflateEnd(&zs);
+    } else {
+        inflateEnd(&zs);
+    }
+    return status;
+}
+
+#ifdef HAVE_ZSTD
+int zstd_threads() {
+    char* env = getenv("SHELL_ZSTD_THREADS");
+    return env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+int run_zstd(ZipJob* job, unsigned char* in, unsigned char* out) {
+    int status = 0;
+    ssize_t n;
+    if (job->compress) {
+        ZSTD_CCtx* cctx = ZSTD_createCCtx();
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, job->level < 0 ? ZSTD_CLEVEL_DEFAULT : job->level);
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_nbWorkers, zstd_threads()); // ignored by single-threaded builds
+        do {
+            if ((n = read_retry(job->in_fd, in, ZIP_BUF_SIZE)) < 0) {
+                status = -1;
+                break;
+            }
+            ZSTD_EndDirective mode = n == 0 ? ZSTD_e_end : ZSTD_e_continue;
+            ZSTD_inBuffer input = {in, (size_t)n, 0};
+            size_t remaining;
+            do {
+                ZSTD_outBuffer output = {out, ZIP_BUF_SIZE, 0};
+                remaining = ZSTD_compressStream2(cctx, &output, &input, mode);
+                if (ZSTD_isError(remaining) || write_all(job->out_fd, (char*)out, output.pos) < 0) {
+                    status = -1;
+                    break;
+                }
+            } while (n == 0 ? remaining != 0 : input.pos < input.size);
+        } while (n > 0 && status == 0);
+        ZSTD_freeCCtx(cctx);
+    } else {
+        ZSTD_DCtx* dctx = ZSTD_createDCtx();
+        size_t last = 0;
+        while (status == 0 && (n = read_retry(job->in_fd, in, ZIP_BUF_SIZE)) > 0) {
+            ZSTD_inBuffer input = {in, (size_t)n, 0};
+            while (input.pos < input.size) {
+                ZSTD_outBuffer output = {out, ZIP_BUF_SIZE, 0};
+                last = ZSTD_decompressStream(dctx, &output, &input);
+                if (ZSTD_isError(last) || write_all(job->out_fd, (char*)out, output.pos) < 0) {
+                    status = -1;
+                    break;
+                }
+            }
+        }
+        if (n < 0 || last != 0) {
+            status = -1;
+        }
+        ZSTD_freeDCtx(dctx);
+    }
+    return status;
+}
+#endif
+
+void* zip_thread(void* arg) {
+    ZipJob* job = arg;
+    // A reader that quits early should show up as EPIPE here, not kill the shell
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    unsigned char* in = malloc(ZIP_BUF_SIZE);
+    unsigned char* out = malloc(ZIP_BUF_SIZE);
+    int status = -1;
+    if (in && out) {
+#ifdef HAVE_ZSTD
+        status = job->zstd ? run_zstd(job, in, out) : run_zlib(job, in, out);
+#else
+        status = run_zlib(job, in, out);
+#endif
+    }
+    if (status < 0 && errno != EPIPE) {
+        fprintf(stderr, "%s: %s failed\n", job->path, job->compress ? "compression" : "decompression");
+    }
+    free(in);
+    free(out);
+    close(job->in_fd);
+    close(job->out_fd);
+    free_zip_job(job);
+    pthread_mutex_lock(&zip_lock);
+    zip_active--;
+    pthread_cond_signal(&zip_done);
+    pthread_mutex_unlock(&zip_lock);
+    return NULL;
+}
+
+int has_suffix(const char* text, const char* suffix) {
+    size_t n = strlen(text), k = strlen(suffix);
+    return n >= k && strcmp(text + n - k, suffix) == 0;
+}
+
+// Refuse a ">z" output whose codec is not built in or does not accept the
+// requested level, before the pipeline opens or starts anything
+int check_zip_output(const Stage* stage) {
+    if (!stage->output_file || !stage->zip_output) {
+        return 0;
+    }
+    int zstd = has_suffix(stage->output_file, ".zst");
+#ifndef HAVE_ZSTD
+    if (zstd) {
+        fprintf(stderr, "%s: zstd support not built in (compile with -DHAVE_ZSTD -lzstd)\n", stage->output_file);
+        return -1;
+    }
+#endif
+    int lowest = zstd ? 1 : 0, highest = zstd ? 22 : 9;
+    if (stage->zip_level >= 0 && (stage->zip_level < lowest || stage->zip_level > highest)) {
+        fprintf(stderr, "%s: %s compression level must be %d-%d\n", stage->output_file, zstd ? "zstd" : "gzip",
+                lowest, highest);
+        return -1;
+    }
+    return 0;
+}
+
+// Open path and start a codec thread on it. Returns the pipe end the stage
+// should use as stdout (compress) or stdin (decompress); the thread's own fds
+// go to thread_fds so other stage children can close them.
+int start_zip_job(const char* path, int compress, int level, pthread_t* thread, int* thread_fds) {
+    int file_fd = compress ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)
+                           : open(path, O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        perror(compress ? "Output file open failed" : "Input file open failed");
+        return -1;
+    }
+    ZipJob* job = malloc(sizeof(ZipJob));
+    job->compress = compress;
+    job->level = level;
+    job->path = strdup(path);
+    if (compress) {
+        job->zstd = has_suffix(path, ".zst");
+    } else {
+        unsigned char magic[4];
+        job->zstd = pread(file_fd, magic, 4, 0) == 4 && memcmp(magic, "\x28\xb5\x2f\xfd", 4) == 0;
+    }
+#ifndef HAVE_ZSTD
+    if (job->zstd) {
+        fprintf(stderr, "%s: zstd support not built in (compile with -DHAVE_ZSTD -lzstd)\n", path);
+        close(file_fd);
+        free_zip_job(job);
+        return -1;
+    }
+#endif
+
+    int fd[2];
+    if (pipe2(fd, O_CLOEXEC) < 0) {
+        perror("pipe failed");
+        close(file_fd);
+        free_zip_job(job);
+        return -1;
+    }
+    job->in_fd = compress ? fd[0] : file_fd;
+    job->out_fd = compress ? file_fd : fd[1];
+    thread_fds[0] = job->in_fd;
+    thread_fds[1] = job->out_fd;
+    int stage_fd = compress ? fd[1] : fd[0];
+    pthread_mutex_lock(&zip_lock);
+    zip_active++;
+    pthread_mutex_unlock(&zip_lock);
+    if (pthread_create(thread, NULL, zip_thread, job) != 0) {
+        perror("pthread_create failed");
+        pthread_mutex_lock(&zip_lock);
+        zip_active--;
+        pthread_mutex_unlock(&zip_lock);
+        close(fd[0]);
+        close(fd[1]);
+        close(file_fd);
+        free_zip_job(job);
+        return -1;
+    }
+    return stage_fd;
+}
+
+#else
+void wait_zip_jobs() {
+}
+
+int check_zip_output(const Stage* stage) {
+    if (stage->zip_output || stage->unzip_input) {
+        fprintf(stderr, "%s: compressed redirection not built in\n",
+                stage->zip_output ? stage->output_file : stage->input_file);
+        return -1;
+    }
+    return 0;
+}
+
+int start_zip_job(const char* path, int compress, int level, pthread_t* thread, int* thread_fds) {
+    fprintf(stderr, "%s: compressed redirection not built in\n", path);
+    return -1;
+}
+#endif
+
+// Accept ">z", ">zN" (N = compression level) and "<z"
+int parse_zip_redirect(const char* token, int* level) {
+    if ((token[0] != '<' && token[0] != '>') || token[1] != 'z') {
+        return 0;
+    }
+    if (token[0] == '<') {
+        return token[2] == '\0';
+    }
+    for (const char* p = token + 2; *p; p++) {
+        if (*p < '0' || *p > '9') {
+            return 0;
+        }
+    }
+    *level = token[2] ? atoi(token + 2) : -1;
+    return 1;
+}
+
+// Parse one pipeline stage, pulling "< file", "> file", "<z file" and ">z file" out of its arguments
+void parse_stage(char* text, Stage* stage) {
+    char** tokens = tokenize(text);
+    stage->argv = tokens;
+    stage->argc = 0;
+    stage->input_file = NULL;
+    stage->output_file = NULL;
+    stage->shards = 0;
+    stage->shard_key = 0;
+    stage->shard_unordered = 0;
+    stage->zip_output = 0;
+    stage->zip_level = -1;
+    stage->unzip_input = 0;
+
+    for (int j = 0; tokens[j] != NULL; j++) {
+        int level = -1;
+        int zip = parse_zip_redirect(tokens[j], &level);
+        if ((zip || strcmp(tokens[j], "<") == 0 || strcmp(tokens[j], ">") == 0) && tokens[j + 1] != NULL) {
+            if (tokens[j][0] == '<') {
+                free(stage->input_file);
+                stage->input_file = tokens[j + 1];
+                stage->unzip_input = zip;
+            } else {
+                free(stage->output_file);
+                stage->output_file = tokens[j + 1];
+                stage->zip_output = zip;
+                stage->zip_level = level;
+            }
+            free(tokens[j]);
+            j++;
+        } else {
+            tokens[stage->argc++] = tokens[j];
+        }
+    }
+    tokens[stage->argc] = NULL;
+}
+
+void free_stage(Stage* stage) {
+    for (int j = 0; j < stage->argc; j++) {
+        free(stage->argv[j]);
+    }
+    free(stage->argv);
+    free(stage->input_file);
+    free(stage->output_file);
+}
+
+void remove_stage(Stage* stages, int* count, int i) {
+    free_stage(&stages[i]);
+    memmove(&stages[i], &stages[i + 1], sizeof(Stage) * (*count - i - 1));
+    (*count)--;
+}
+
+// A stage that is just "cat" with no files or options copies stdin to stdout
+int is_plain_cat(Stage* stage) {
+    return stage->argc == 1 && strcmp(stage->argv[0], "cat") == 0 && stage->input_file == NULL &&
+           stage->shards == 0;
+}
+
+// Rewrite pipelines into cheaper equivalents with the same output:
+//   cat f | cmd      ->  cmd < f   (also cat < f | cmd)
+//   a | cat | b      ->  a | b
+//   cmd | cat > out  ->  cmd > out
+//   cmd | cat        ->  cmd   (only when stdout is not a terminal)
+int optimize_pipeline(Stage* stages, int* count) {
+    int rewritten = 0;
+    struct stat st;
+
+    while (*count > 1 && strcmp(stages[0].argv[0], "cat") == 0 && stages[0].output_file == NULL &&
+        stages[1].input_file == NULL) {
+        char** source = NULL;
+        if (stages[0].argc == 1 && stages[0].input_file != NULL) {
+            source = &stages[0].input_file;
+        } else if (stages[0].argc == 2 && stages[0].input_file == NULL && stages[0].argv[1][0] != '-' &&
+                   stat(stages[0].argv[1], &st) == 0 && S_ISREG(st.st_mode) &&
+                   access(stages[0].argv[1], R_OK) == 0) {
+            source = &stages[0].argv[1];
+            stages[0].argc = 1;
+        }
+        if (source == NULL) {
+            break;
+        }
+        stages[1].input_file = *source;
+        stages[1].unzip_input = source == &stages[0].input_file && stages[0].unzip_input;
+        *source = NULL;
+        remove_stage(stages, count, 0);
+        rewritten = 1;
+    }
+
+    for (int i = 1; i < *count; i++) {
+        if (!is_plain_cat(&stages[i])) {
+            continue;
+        }
+        int last = i == *count - 1;
+        if (!last && stages[i].output_file == NULL) {
+            remove_stage(stages, count, i--);
+            rewritten = 1;
+        } else if (last && stages[i - 1].output_file == NULL &&
+                   (stages[i].output_file != NULL || !isatty(STDOUT_FILENO))) {
+            stages[i - 1].output_file = stages[i].output_file;
+            stages[i - 1].zip_output = stages[i].zip_output;
+            stages[i - 1].zip_level = stages[i].zip_level;
+            stages[i].output_file = NULL;
+            remove_stage(stages, count, i--);
+            rewritten = 1;
+        }
+    }
+    return rewritten;
+}
+
+void explain_pipeline(Stage* stages, int count, int rewritten) {
+    fprintf(stderr, "plan%s:", rewritten ? " (rewritten)" : "");
+    for (int i = 0; i < count; i++) {
+        if (stages[i].shards > 0) {
+            int show_unordered = stages[i].shard_unordered && stages[i].shard_key == 0;
+            fprintf(stderr, " |[%d%s", stages[i].shards, show_unordered ? ":u" : "");
+            if (stages[i].shard_key > 0) {
+                fprintf(stderr, ":k%d", stages[i].shard_key);
+            }
+            fprintf(stderr, "]");
+        } else if (i > 0) {
+            fprintf(stderr, " |");
+        }
+        for (int j = 0; j < stages[i].argc; j++) {
+            fprintf(stderr, " %s", stages[i].argv[j]);
+        }
+        if (stages[i].input_file) {
+            fprintf(stderr, " <%s %s", stages[i].unzip_input ? "z" : "", stages[i].input_file);
+        }
+        if (stages[i].output_file && stages[i].zip_output && stages[i].zip_level >= 0) {
+            fprintf(stderr, " >z%d %s", stages[i].zip_level, stages[i].output_file);
+        } else if (stages[i].output_file) {
+            fprintf(stderr, " >%s %s", stages[i].zip_output ? "z" : "", stages[i].output_file);
+        }
+        TextStage text;
+        if (classify_text_stage(&stages[i], &text) != TEXT_NONE) {
+            fprintf(stderr, " [in-process]");
+        }
+    }
+    fprintf(stderr, "\n");
+}
+
+// Handle "set -o <option>" / "set +o <option>"
+int set_option(char* cmdline) {
+    char* flag = strtok(cmdline + 4, " \t");
+    char* name = strtok(NULL, " \t");
+    if (flag == NULL || name == NULL || (strcmp(flag, "-o") != 0 && strcmp(flag, "+o") != 0)) {
+        fprintf(stderr, "Usage: set -o|+o explain|textstages\n");
+        return -1;
+    }
+    if (strcmp(name, "explain") == 0) {
+        explain_mode = flag[0] == '-';
+    } else if (strcmp(name, "textstages") == 0) {
+        text_stages_enabled = flag[0] == '-';
+    } else {
+        fprintf(stderr, "Unknown option: %s\n", name);
+        return -1;
+    }
+    return 0;
+}
+
 int process_command(char* cmdline) {
     char* cmds[MAXARGS];
+    Stage stages[MAXARGS];
     int cmd_count = 0;
     int is_background = 0;
 
+    if (strncmp(cmdline, "set ", 4) == 0) {
+        return set_option(cmdline);
+    }
+
     // Check for background process indicator '&'
     int len = strlen(cmdline);
-    if (cmdline[len - 1] == '&') {
+    if (len > 0 && cmdline[len - 1] == '&') {
         is_background = 1;
         cmdline[len - 1] = '\0'; // Remove '&' from the command
     }
@@ -59,35 +1218,88 @@ int process_command(char* cmdline) {
         token = strtok(NULL, "|");
     }
 
+    // Parse every stage before launching anything so the plan can be rewritten
+    for (int i = 0; i < cmd_count; i++) {
+        Stage spec = {0};
+        char* text = i > 0 ? parse_shard_spec(cmds[i], &spec) : cmds[i];
+        if (text == NULL) {
+            for (int j = 0; j < i; j++) {
+                free_stage(&stages[j]);
+            }
+            return -1;
+        }
+        parse_stage(text, &stages[i]);
+        stages[i].shards = spec.shards;
+        stages[i].shard_key = spec.shard_key;
+        stages[i].shard_unordered = spec.shard_unordered;
+    }
+    for (int i = 0; i < cmd_count; i++) {
+        if (stages[i].argc == 0 || check_zip_output(&stages[i]) < 0) {
+            if (stages[i].argc == 0) {
+                fprintf(stderr, "Error: empty command\n");
+            }
+            for (int j = 0; j < cmd_count; j++) {
+                free_stage(&stages[j]);
+            }
+            return -1;
+        }
+    }
+    int rewritten = optimize_pipeline(stages, &cmd_count);
+    if (explain_mode) {
+        explain_pipeline(stages, cmd_count, rewritten);
+    }
+
     int in_fd = 0; // Initial input is stdin
     int fd[2];
+    int status = 0;
+    pid_t pids[MAXARGS];
+    int pid_count = 0;
+    pthread_t zip_threads[MAXARGS * 2];
+    int zip_fds[MAXARGS * 4];
+    int zip_count = 0;
 
     // Loop through each command
     for (int i = 0; i < cmd_count; i++) {
-        char** arglist = tokenize(cmds[i]);
-
         // Variables for input and output redirection
         int input_redirect = -1;
         int output_redirect = -1;
 
-        // Check for input/output redirection in arguments
-        for (int j = 0; arglist[j] != NULL; j++) {
-            if (strcmp(arglist[j], "<") == 0) {
-                input_redirect = open(arglist[j + 1], O_RDONLY);
-                if (input_redirect < 0) {
-                    perror("Input file open failed");
-                    return -1;
+        if (stages[i].input_file && stages[i].unzip_input) {
+            input_redirect = start_zip_job(stages[i].input_file, 0, -1, &zip_threads[zip_count],
+                                           &zip_fds[zip_count * 2]);
+            if (input_redirect < 0) {
+                status = -1;
+                break;
+            }
+            zip_count++;
+        } else if (stages[i].input_file) {
+            input_redirect = open(stages[i].input_file, O_RDONLY);
+            if (input_redirect < 0) {
+                perror("Input file open failed");
+                status = -1;
+                break;
+            }
+        }
+        if (stages[i].output_file && stages[i].zip_output) {
+            output_redirect = start_zip_job(stages[i].output_file, 1, stages[i].zip_level, &zip_threads[zip_count],
+                                            &zip_fds[zip_count * 2]);
+            if (output_redirect < 0) {
+                if (input_redirect != -1) {
+                    close(input_redirect);
                 }
-                free(arglist[j]);
-                arglist[j] = NULL;
-            } else if (strcmp(arglist[j], ">") == 0) {
-                output_redirect = open(arglist[j + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (output_redirect < 0) {
-                    perror("Output file open failed");
-                    return -1;
+                status = -1;
+                break;
+            }
+            zip_count++;
+        } else if (stages[i].output_file) {
+            output_redirect = open(stages[i].output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (output_redirect < 0) {
+                perror("Output file open failed");
+                if (input_redirect != -1) {
+                    close(input_redirect);
                 }
-                free(arglist[j]);
-                arglist[j] = NULL;
+                status = -1;
+                break;
             }
         }
 
@@ -96,39 +1308,51 @@ int process_command(char* cmdline) {
             pipe(fd);
         }
 
+        fflush(stdout); // Text stages run without exec, so don't let them inherit buffered output
         pid_t pid = fork();
         if (pid == 0) {
             // Child process
 
+            // Codec threads' ends of their pipes must not be held open by stages that don't exec
+            for (int k = 0; k < zip_count * 2; k++) {
+                close(zip_fds[k]);
+            }
+
             // Redirect input
             if (input_redirect != -1) {
                 dup2(input_redirect, 0);
                 close(input_redirect);
             } else if (in_fd != 0) {
                 dup2(in_fd, 0);
+            }
+            if (in_fd != 0) {
                 close(in_fd);
             }
 
-            // Redirect output
+            // Redirect output. The read end of our own output pipe must be
+            // closed too, or the stage never sees EPIPE when its reader exits.
             if (output_redirect != -1) {
                 dup2(output_redirect, 1);
                 close(output_redirect);
             } else if (i < cmd_count - 1) {
                 dup2(fd[1], 1);
+            }
+            if (i < cmd_count - 1) {
+                close(fd[0]);
                 close(fd[1]);
             }
 
-            execvp(arglist[0], arglist);
-            perror("exec failed");
-            exit(1);
-        }
-
-        if (!is_background) {
-            // Wait for the foreground process to finish
-            waitpid(pid, NULL, 0);
+            if (stages[i].shards > 0) {
+                exit(run_sharded_stage(&stages[i]));
+            }
+            exec_stage(&stages[i]);
         }
+        pids[pid_count++] = pid;
 
         // Close pipe ends and update in_fd
+        if (in_fd != 0) {
+            close(in_fd);
+        }
         if (i < cmd_count - 1) {
             close(fd[1]);
             in_fd = fd[0];
@@ -140,19 +1364,33 @@ int process_command(char* cmdline) {
         if (output_redirect != -1) {
             close(output_redirect);
         }
+    }
 
-        // Free memory for each command
-        for (int j = 0; j < MAXARGS + 1; j++) {
-            free(arglist[j]);
+    if (!is_background) {
+        // Wait for the foreground pipeline once every stage is running
+        for (int i = 0; i < pid_count; i++) {
+            waitpid(pids[i], NULL, 0);
+        }
+    }
+    // Codec threads finish once their stage closes the pipe; a background pipeline leaves them running
+    for (int i = 0; i < zip_count; i++) {
+        if (is_background) {
+            pthread_detach(zip_threads[i]);
+        } else {
+            pthread_join(zip_threads[i], NULL);
         }
-        free(arglist);
     }
 
-    if (is_background) {
+    // Free memory for each command
+    for (int i = 0; i < cmd_count; i++) {
+        free_stage(&stages[i]);
+    }
+
+    if (is_background && status == 0) {
         printf("[Background] Process started with PID %d\n", getpid());
     }
 
-    return 0;
+    return status;
 }
 
 char** tokenize(char* cmdline) {
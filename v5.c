@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,141 +7,3182 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/signalfd.h>
+#include <poll.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <linux/mempolicy.h>
+#ifndef NO_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <pthread.h>
+void init_completion();
+#define INTERACTIVE_SETUP() init_completion()
+#endif
+#include "line_reader.h"
 
 #define MAX_LEN 512
 #define MAXARGS 10
 #define PROMPT "ELEVENshell:- "
 #define HISTORY_SIZE 10
 #define MAX_JOBS 100
+#define MAX_COPROCS 8
+#define DIRENT_BUF_SIZE 32768
+#define RADIX_CUTOFF 32
+#define CPU_PERIOD_USEC 100000
+#define MAX_NUMA_NODES 64
+#define ZYGOTE_MSG_SIZE 65536
+#define ZYGOTE_SPAWNED 1
+#define ZYGOTE_EXITED 2
+#define ARG_HEADROOM 4096
+#define CACHE_MAGIC 0x45534331
+#define CACHE_DEFAULT_ENV "PATH:LANG:LC_ALL"
+#define JOB_RING_SIZE (1024 * 1024)
+#define JOB_RING_MIN 4096
+#define JOB_CAPTURE_MEM (16 * 1024 * 1024)
+#define WATCH_INTERVAL_MS 1000
+#define TIMEOUT_GRACE_MS 1000
+#define COMPLETE_MAX_MATCHES 256
+#define COMPLETE_READ_BYTES (128 << 10)
+#define COMPLETE_RECHECK_MS 1000
+#define WATCH_DEBOUNCE_MS 100
+#define WATCH_MAX_DELAY 10
+#define WATCH_MASK (IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB)
 
 typedef struct {
     pid_t pid;
     char cmdline[MAX_LEN];
+    char cgroup[MAX_LEN];
     int active;
+    int out_fd;                     // read end of the captured stdout/stderr pipe, -1 if none
+    char* ring;                     // last ring_size bytes of output
+    size_t ring_size;
+    unsigned long long ring_total;  // bytes captured so far; ring position is total % size
+    int spill_fd;                   // output goes here instead of the ring once spilled
 } Job;
 
 Job jobs[MAX_JOBS];
 int job_count = 0;
+int cgroup_seq = 0;
 
-void add_job(pid_t pid, const char* cmdline) {
-    if (job_count < MAX_JOBS) {
-        jobs[job_count].pid = pid;
-        strncpy(jobs[job_count].cmdline, cmdline, MAX_LEN);
-        jobs[job_count].active = 1;
-        job_count++;
+void release_job_ring(Job* job);
+
+// Keep SIGCHLD blocked from fork until the job is in the table, so a child
+// that exits at once is not reaped before add_job can record it
+void block_sigchld(sigset_t* old_mask) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+// Slot for a new job: an unused one while the table has room, then a
+// finished job with no open output pipe or cgroup, preferring one whose
+// captured output is already gone
+Job* free_job_slot() {
+    if (job_count < MAX_JOBS) return &jobs[job_count];
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < MAX_JOBS; i++) {
+            if (!jobs[i].active && jobs[i].out_fd < 0 && jobs[i].cgroup[0] == '\0' &&
+                (pass == 1 || (jobs[i].ring == NULL && jobs[i].spill_fd < 0))) {
+                return &jobs[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+int job_slot_available() {
+    return free_job_slot() != NULL;
+}
+
+Job* add_job(pid_t pid, const char* cmdline) {
+    Job* job = free_job_slot();
+    if (job == NULL) {
+        fprintf(stderr, "Error: job table full, PID %d is not tracked\n", pid);
+        return NULL;
+    }
+    if (job->ring != NULL) release_job_ring(job);
+    if (job < &jobs[job_count] && job->spill_fd >= 0) close(job->spill_fd);
+    job->pid = pid;
+    snprintf(job->cmdline, sizeof(job->cmdline), "%s", cmdline);
+    job->cgroup[0] = '\0';
+    job->active = 1;
+    job->out_fd = -1;
+    job->ring = NULL;
+    job->ring_size = 0;
+    job->ring_total = 0;
+    job->spill_fd = -1;
+    // A fresh slot only becomes visible to the SIGIO/SIGCHLD handlers once filled in
+    if (job == &jobs[job_count]) job_count++;
+    return job;
+}
+
+int write_cgroup_file(const char* cgroup, const char* file, const char* value) {
+    char path[MAX_LEN * 2];
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+    return n < 0 ? -1 : 0;
+}
+
+long long read_cgroup_value(const char* cgroup, const char* file, const char* key) {
+    char path[MAX_LEN * 2];
+    char name[64];
+    long long value;
+    snprintf(path, sizeof(path), "%s/%s", cgroup, file);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    if (key == NULL) {
+        if (fscanf(fp, "%lld", &value) != 1) value = -1;
+        fclose(fp);
+        return value;
+    }
+    while (fscanf(fp, "%63s %lld", name, &value) == 2) {
+        if (strcmp(name, key) == 0) {
+            fclose(fp);
+            return value;
+        }
+    }
+    fclose(fp);
+    return -1;
+}
+
+// Move every process of base into the leaf base/shell. cgroup v2 only lets
+// a cgroup without processes of its own enable controllers for children.
+int move_to_shell_leaf(const char* base) {
+    char leaf[MAX_LEN * 2], path[MAX_LEN * 2], pid[32];
+    snprintf(leaf, sizeof(leaf), "%s/shell", base);
+    if (mkdir(leaf, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "limit: cannot create %s: %s\n", leaf, strerror(errno));
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/cgroup.procs", base);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "limit: cannot read %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    int status = 0;
+    while (fscanf(fp, "%31s", pid) == 1) {
+        if (write_cgroup_file(leaf, "cgroup.procs", pid) < 0 && errno != ESRCH) {
+            fprintf(stderr, "limit: cannot move PID %s to %s: %s\n", pid, leaf, strerror(errno));
+            status = -1;
+        }
+    }
+    fclose(fp);
+    return status;
+}
+
+// Parent of the job leaves: $LIMIT_CGROUP_ROOT, else the shell's own
+// cgroup, whose processes move to a "shell" leaf on first use so the job
+// leaves can be its siblings. The root cgroup is exempt from that rule.
+int find_cgroup_base(char* base, size_t size) {
+    static char own_base[MAX_LEN * 2];
+    const char* root = getenv("LIMIT_CGROUP_ROOT");
+    if (root != NULL) {
+        snprintf(base, size, "%s", root);
+        return 0;
+    }
+    if (own_base[0] != '\0') {
+        snprintf(base, size, "%s", own_base);
+        return 0;
+    }
+
+    char mount[MAX_LEN] = "";
+    char dev[MAX_LEN], dir[MAX_LEN], type[64], line[MAX_LEN * 2];
+    FILE* fp = fopen("/proc/self/mounts", "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "%511s %511s %63s", dev, dir, type) == 3 && strcmp(type, "cgroup2") == 0) {
+            strcpy(mount, dir);
+            break;
+        }
+    }
+    fclose(fp);
+
+    char self[MAX_LEN * 2] = "";
+    fp = fopen("/proc/self/cgroup", "r");
+    if (!fp) return -1;
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(self, sizeof(self), "%s", strcmp(line + 3, "/") == 0 ? "" : line + 3);
+            break;
+        }
+    }
+    fclose(fp);
+
+    if (mount[0] == '\0') return -1;
+    snprintf(base, size, "%s%s", mount, self);
+    if (self[0] != '\0' && move_to_shell_leaf(base) < 0) return -1;
+    snprintf(own_base, sizeof(own_base), "%s", base);
+    return 0;
+}
+
+// Whole byte count with an optional K/M/G/T suffix, or -1 when the text is
+// not one (fractions such as "1.5G" included)
+long long parse_size(const char* text) {
+    char* end;
+    int shift = 0;
+    errno = 0;
+    long long value = strtoll(text, &end, 10);
+    if (end == text || value < 0 || errno == ERANGE) return -1;
+    switch (*end) {
+        case 'T': case 't': shift = 40; break;
+        case 'G': case 'g': shift = 30; break;
+        case 'M': case 'm': shift = 20; break;
+        case 'K': case 'k': shift = 10; break;
+    }
+    if (shift) end++;
+    if (*end != '\0' || value > (LLONG_MAX >> shift)) return -1;
+    return value << shift;
+}
+
+// Enable a controller for the children of base unless it already is
+int enable_controller(const char* base, const char* name) {
+    char path[MAX_LEN * 2], word[64], value[64];
+    snprintf(path, sizeof(path), "%s/cgroup.subtree_control", base);
+    FILE* fp = fopen(path, "r");
+    if (fp) {
+        while (fscanf(fp, "%63s", word) == 1) {
+            if (strcmp(word, name) == 0) {
+                fclose(fp);
+                return 0;
+            }
+        }
+        fclose(fp);
+    }
+    snprintf(value, sizeof(value), "+%s", name);
+    if (write_cgroup_file(base, "cgroup.subtree_control", value) < 0) {
+        fprintf(stderr, "limit: cannot enable the %s controller in %s: %s\n", name, base, strerror(errno));
+        if (errno == EBUSY) {
+            fprintf(stderr, "limit: that cgroup has processes of its own; set LIMIT_CGROUP_ROOT to a delegated subtree\n");
+        }
+        return -1;
+    }
+    return 0;
+}
+
+char** setup_limit(char** arglist, char* cgroup, size_t size) {
+    const char* cpu = NULL;
+    const char* mem = NULL;
+    const char* io = NULL;
+    int i = 1;
+    for (; arglist[i] != NULL && strncmp(arglist[i], "--", 2) == 0; i += 2) {
+        if (arglist[i + 1] == NULL) break;
+        if (strcmp(arglist[i], "--cpu") == 0) cpu = arglist[i + 1];
+        else if (strcmp(arglist[i], "--mem") == 0) mem = arglist[i + 1];
+        else if (strcmp(arglist[i], "--io") == 0) io = arglist[i + 1];
+        else break;
+    }
+    if (arglist[i] == NULL || strncmp(arglist[i], "--", 2) == 0) {
+        fprintf(stderr, "Usage: limit [--cpu <cpus>] [--mem <size>] [--io <maj:min>,<key=value>[,...]] <command> [args...]\n");
+        return NULL;
+    }
+
+    char* end;
+    double cpus = cpu ? strtod(cpu, &end) : 0;
+    if (cpu && (end == cpu || *end != '\0' || cpus <= 0)) {
+        fprintf(stderr, "limit: invalid CPU count: %s\n", cpu);
+        return NULL;
+    }
+    long long mem_bytes = mem ? parse_size(mem) : 0;
+    if (mem && mem_bytes <= 0) {
+        fprintf(stderr, "limit: invalid memory size: %s (use a whole number with an optional K, M, G or T suffix)\n", mem);
+        return NULL;
+    }
+    // io.max takes "<maj:min> key=value ..."; the shell has no quoting, so
+    // the fields arrive as one comma-separated word
+    char io_value[MAX_LEN] = "";
+    if (io) {
+        snprintf(io_value, sizeof(io_value), "%s", io);
+        for (char* c = io_value; *c; c++) {
+            if (*c == ',') *c = ' ';
+        }
+        if (strchr(io_value, ':') == NULL || strchr(io_value, '=') == NULL) {
+            fprintf(stderr, "limit: invalid io setting: %s (e.g. 8:0,rbps=1048576)\n", io);
+            return NULL;
+        }
+    }
+
+    char base[MAX_LEN * 2];
+    if (find_cgroup_base(base, sizeof(base)) < 0) {
+        fprintf(stderr, "limit: no usable cgroup v2 hierarchy found (set LIMIT_CGROUP_ROOT)\n");
+        return NULL;
+    }
+    if ((cpu && enable_controller(base, "cpu") < 0) || (mem && enable_controller(base, "memory") < 0) ||
+        (io && enable_controller(base, "io") < 0)) {
+        return NULL;
+    }
+
+    snprintf(cgroup, size, "%s/shell-%d-%d", base, getpid(), ++cgroup_seq);
+    if (mkdir(cgroup, 0755) < 0) {
+        perror("limit: cannot create cgroup");
+        cgroup[0] = '\0';
+        return NULL;
+    }
+
+    char value[MAX_LEN];
+    const char* failed = NULL;
+    if (cpu) {
+        snprintf(value, sizeof(value), "%lld %d", (long long)(cpus * CPU_PERIOD_USEC), CPU_PERIOD_USEC);
+        if (write_cgroup_file(cgroup, "cpu.max", value) < 0) failed = "cpu.max";
+    }
+    if (mem && !failed) {
+        snprintf(value, sizeof(value), "%lld", mem_bytes);
+        if (write_cgroup_file(cgroup, "memory.max", value) < 0) failed = "memory.max";
+    }
+    if (io && !failed) {
+        if (write_cgroup_file(cgroup, "io.max", io_value) < 0) failed = "io.max";
+    }
+    if (failed) {
+        fprintf(stderr, "limit: cannot set %s: %s\n", failed, strerror(errno));
+        rmdir(cgroup);
+        cgroup[0] = '\0';
+        return NULL;
+    }
+    return arglist + i;
+}
+
+void release_job_cgroups() {
+    for (int i = 0; i < job_count; i++) {
+        if (!jobs[i].active && jobs[i].cgroup[0] != '\0') {
+            if (rmdir(jobs[i].cgroup) == 0 || errno == ENOENT) {
+                jobs[i].cgroup[0] = '\0';
+            }
+        }
+    }
+}
+
+void list_jobs() {
+    printf("Background jobs:\n");
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].active || jobs[i].ring != NULL) {
+            printf("[%d] %sPID: %d, Command: %s", i + 1, jobs[i].active ? "" : "Done ", jobs[i].pid,
+                   jobs[i].cmdline);
+            if (jobs[i].ring != NULL || jobs[i].spill_fd >= 0) {
+                printf(", Output: %lluB%s", jobs[i].ring_total, jobs[i].spill_fd >= 0 ? " (spilled)" : "");
+            }
+            if (jobs[i].cgroup[0] != '\0') {
+                long long usec = read_cgroup_value(jobs[i].cgroup, "cpu.stat", "usage_usec");
+                long long mem = read_cgroup_value(jobs[i].cgroup, "memory.current", NULL);
+                if (usec >= 0) printf(", CPU: %.2fs", usec / 1e6);
+                if (mem >= 0) printf(", Mem: %.1fM", mem / 1048576.0);
+            }
+            printf("\n");
+        }
+    }
+}
+
+void remove_job(pid_t pid) {
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].active && jobs[i].pid == pid) {
+            jobs[i].active = 0;
+            break;
+        }
+    }
+}
+
+typedef struct {
+    char name[32];
+    char* argv[MAXARGS + 1];
+    pid_t pid;
+    int to_fd;
+    FILE* from;
+    int restart;
+    int active;
+} Coproc;
+
+Coproc coprocs[MAX_COPROCS];
+
+void handle_sigchld(int sig) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        remove_job(pid);
+        for (int i = 0; i < MAX_COPROCS; i++) {
+            if (coprocs[i].active && coprocs[i].pid == pid) {
+                coprocs[i].pid = 0;
+            }
+        }
+    }
+}
+
+Coproc* find_coproc(const char* name) {
+    for (int i = 0; i < MAX_COPROCS; i++) {
+        if (coprocs[i].active && strcmp(coprocs[i].name, name) == 0) {
+            return &coprocs[i];
+        }
+    }
+    return NULL;
+}
+
+void close_coproc_fds(Coproc* cp) {
+    if (cp->to_fd >= 0) {
+        close(cp->to_fd);
+        cp->to_fd = -1;
+    }
+    if (cp->from) {
+        fclose(cp->from);
+        cp->from = NULL;
+    }
+}
+
+int spawn_coproc(Coproc* cp) {
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) < 0) {
+        perror("coproc pipe failed");
+        return -1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0) {
+        perror("coproc pipe failed");
+        close(to_child[0]);
+        close(to_child[1]);
+        return -1;
+    }
+
+    // A coproc that dies at once must not be reaped before it is recorded
+    sigset_t old_mask;
+    block_sigchld(&old_mask);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        return -1;
+    } else if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        dup2(to_child[0], STDIN_FILENO);
+        dup2(from_child[1], STDOUT_FILENO);
+        execvp(cp->argv[0], cp->argv);
+        perror("Command execution failed");
+        exit(1);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+    cp->pid = pid;
+    cp->to_fd = to_child[1];
+    cp->from = fdopen(from_child[0], "r");
+
+    char cmdline[MAX_LEN];
+    int len = snprintf(cmdline, sizeof(cmdline), "coproc %s:", cp->name);
+    for (int i = 0; cp->argv[i] != NULL && len < (int)sizeof(cmdline); i++) {
+        len += snprintf(cmdline + len, sizeof(cmdline) - len, " %s", cp->argv[i]);
+    }
+    add_job(pid, cmdline);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 0;
+}
+
+int start_coproc(char** arglist) {
+    int restart = 0;
+    int i = 1;
+    if (arglist[i] != NULL && strcmp(arglist[i], "-r") == 0) {
+        restart = 1;
+        i++;
+    }
+    if (arglist[i] == NULL || arglist[i + 1] == NULL) {
+        fprintf(stderr, "Usage: coproc [-r] <name> <command> [args...]\n");
+        return -1;
+    }
+    if (find_coproc(arglist[i]) != NULL) {
+        fprintf(stderr, "coproc %s already running\n", arglist[i]);
+        return -1;
+    }
+
+    Coproc* cp = NULL;
+    for (int j = 0; j < MAX_COPROCS; j++) {
+        if (!coprocs[j].active) {
+            cp = &coprocs[j];
+            break;
+        }
+    }
+    if (cp == NULL) {
+        fprintf(stderr, "Error: coproc limit reached\n");
+        return -1;
+    }
+
+    memset(cp, 0, sizeof(*cp));
+    strncpy(cp->name, arglist[i], sizeof(cp->name) - 1);
+    int argc = 0;
+    for (i++; arglist[i] != NULL; i++) {
+        cp->argv[argc++] = strdup(arglist[i]);
+    }
+    cp->argv[argc] = NULL;
+    cp->restart = restart;
+    cp->to_fd = -1;
+    cp->active = 1;
+
+    if (spawn_coproc(cp) < 0) {
+        for (int j = 0; cp->argv[j] != NULL; j++) free(cp->argv[j]);
+        cp->active = 0;
+        return -1;
+    }
+    printf("[Coproc] %s started with PID %d\n", cp->name, cp->pid);
+    return 0;
+}
+
+int ensure_coproc_running(Coproc* cp) {
+    if (cp->pid != 0) {
+        return 0;
+    }
+    close_coproc_fds(cp);
+    if (!cp->restart) {
+        fprintf(stderr, "coproc %s has exited\n", cp->name);
+        return -1;
+    }
+    if (spawn_coproc(cp) < 0) {
+        return -1;
+    }
+    fprintf(stderr, "[Coproc] %s restarted with PID %d\n", cp->name, cp->pid);
+    return 0;
+}
+
+int write_coproc(Coproc* cp, char** words) {
+    char line[MAX_LEN];
+    int len = 0;
+    for (int i = 0; words[i] != NULL && len < (int)sizeof(line) - 1; i++) {
+        len += snprintf(line + len, sizeof(line) - 1 - len, i ? " %s" : "%s", words[i]);
+    }
+    if (len > (int)sizeof(line) - 2) {
+        len = sizeof(line) - 2;
+    }
+    line[len++] = '\n';
+
+    void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+    ssize_t n = write(cp->to_fd, line, len);
+    signal(SIGPIPE, old_handler);
+    if (n < 0) {
+        perror("coproc write failed");
+        return -1;
+    }
+    return 0;
+}
+
+int read_coproc(Coproc* cp) {
+    char line[MAX_LEN];
+    if (fgets(line, sizeof(line), cp->from) == NULL) {
+        fprintf(stderr, "coproc %s: no more output\n", cp->name);
+        return -1;
+    }
+    fputs(line, stdout);
+    return 0;
+}
+
+void stop_coproc(Coproc* cp) {
+    close_coproc_fds(cp);
+    if (cp->pid != 0) {
+        kill(cp->pid, SIGTERM);
+        remove_job(cp->pid);
+    }
+    for (int i = 0; cp->argv[i] != NULL; i++) free(cp->argv[i]);
+    cp->active = 0;
+}
+
+void handle_coproc(char** arglist) {
+    if (arglist[1] == NULL) {
+        for (int i = 0; i < MAX_COPROCS; i++) {
+            if (coprocs[i].active) {
+                printf("%s PID: %d%s\n", coprocs[i].name, coprocs[i].pid,
+                       coprocs[i].pid == 0 ? " (exited)" : "");
+            }
+        }
+        return;
+    }
+
+    int is_write = strcmp(arglist[1], "write") == 0;
+    int is_read = strcmp(arglist[1], "read") == 0;
+    int is_stop = strcmp(arglist[1], "stop") == 0;
+    if (!is_write && !is_read && !is_stop) {
+        start_coproc(arglist);
+        return;
+    }
+
+    if (arglist[2] == NULL) {
+        fprintf(stderr, "Usage: coproc %s <name>%s\n", arglist[1], is_write ? " <text...>" : "");
+        return;
+    }
+    Coproc* cp = find_coproc(arglist[2]);
+    if (cp == NULL) {
+        fprintf(stderr, "No such coproc: %s\n", arglist[2]);
+        return;
+    }
+
+    if (is_stop) {
+        stop_coproc(cp);
+    } else if (ensure_coproc_running(cp) == 0) {
+        if (is_write) {
+            write_coproc(cp, arglist + 3);
+        } else {
+            read_coproc(cp);
+        }
+    }
+}
+
+typedef struct {
+    int type;
+    pid_t pid;
+    int status;
+} ZygoteEvent;
+
+int zygote_fd = -1;
+
+void zygote_spawn(int sock, char* msg, int* fds) {
+    extern char** environ;
+    int argc, envc;
+    memcpy(&argc, msg, sizeof(int));
+    memcpy(&envc, msg + sizeof(int), sizeof(int));
+    char** argv = malloc(sizeof(char*) * (argc + envc + 2));
+    char** envp = argv + argc + 1;
+    char* p = msg + 2 * sizeof(int);
+    for (int i = 0; i < argc; i++) {
+        argv[i] = p;
+        p += strlen(p) + 1;
+    }
+    for (int i = 0; i < envc; i++) {
+        envp[i] = p;
+        p += strlen(p) + 1;
+    }
+    argv[argc] = NULL;
+    envp[envc] = NULL;
+
+    ZygoteEvent ev = {ZYGOTE_SPAWNED, fork(), 0};
+    if (ev.pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        if (fchdir(fds[3]) < 0) {
+            perror("cd failed");
+            _exit(1);
+        }
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+        }
+        for (int i = 0; i < 4; i++) {
+            if (fds[i] > 2) close(fds[i]);
+        }
+        close(sock);
+        environ = envp;
+        execvp(argv[0], argv);
+        perror("Command execution failed");
+        _exit(1);
+    }
+    ev.status = ev.pid < 0 ? errno : 0;
+    for (int i = 0; i < 4; i++) close(fds[i]);
+    free(argv);
+    send(sock, &ev, sizeof(ev), MSG_NOSIGNAL);
+}
+
+void zygote_loop(int sock) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    char* msg = malloc(ZYGOTE_MSG_SIZE);
+    char control[CMSG_SPACE(sizeof(int) * 4)];
+    struct pollfd pfds[2] = {{sock, POLLIN, 0}, {sfd, POLLIN, 0}};
+
+    for (;;) {
+        if (poll(pfds, 2, -1) < 0) continue;
+
+        if (pfds[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            int status;
+            read(sfd, &info, sizeof(info));
+            ZygoteEvent ev = {ZYGOTE_EXITED, 0, 0};
+            while ((ev.pid = waitpid(-1, &status, WNOHANG)) > 0) {
+                ev.status = status;
+                send(sock, &ev, sizeof(ev), MSG_NOSIGNAL);
+            }
+        }
+
+        if (pfds[0].revents & (POLLIN | POLLHUP)) {
+            struct iovec iov = {msg, ZYGOTE_MSG_SIZE};
+            struct msghdr hdr = {0};
+            hdr.msg_iov = &iov;
+            hdr.msg_iovlen = 1;
+            hdr.msg_control = control;
+            hdr.msg_controllen = sizeof(control);
+            ssize_t n = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+            if (n <= 0) exit(0);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+            if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            int fds[4];
+            if (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) continue;
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            zygote_spawn(sock, msg, fds);
+        }
+    }
+}
+
+void start_zygote() {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("zygote socketpair failed");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("zygote fork failed");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    } else if (pid == 0) {
+        close(sv[0]);
+        zygote_loop(sv[1]);
+    }
+    close(sv[1]);
+    zygote_fd = sv[0];
+}
+
+void handle_zygote_event(const ZygoteEvent* ev) {
+    if (ev->type == ZYGOTE_EXITED) {
+        remove_job(ev->pid);
+    }
+}
+
+void drain_zygote_events() {
+    ZygoteEvent ev;
+    if (zygote_fd < 0) return;
+    while (recv(zygote_fd, &ev, sizeof(ev), MSG_DONTWAIT) == sizeof(ev)) {
+        handle_zygote_event(&ev);
+    }
+}
+
+int wait_zygote_event(int type, pid_t pid, ZygoteEvent* out) {
+    for (;;) {
+        ssize_t n = recv(zygote_fd, out, sizeof(*out), 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n != sizeof(*out)) {
+            close(zygote_fd);
+            zygote_fd = -1;
+            return -1;
+        }
+        handle_zygote_event(out);
+        if (out->type == type && (pid == 0 || out->pid == pid)) return 0;
+    }
+}
+
+pid_t zygote_launch(char** argv, int in_fd, int out_fd, int err_fd) {
+    extern char** environ;
+    char* msg = malloc(ZYGOTE_MSG_SIZE);
+    size_t len = 2 * sizeof(int);
+    int argc = 0, envc = 0;
+    for (char** a = argv; *a != NULL; a++, argc++) {
+        size_t n = strlen(*a) + 1;
+        if (len + n > ZYGOTE_MSG_SIZE) goto too_big;
+        memcpy(msg + len, *a, n);
+        len += n;
+    }
+    for (char** e = environ; *e != NULL; e++, envc++) {
+        size_t n = strlen(*e) + 1;
+        if (len + n > ZYGOTE_MSG_SIZE) goto too_big;
+        memcpy(msg + len, *e, n);
+        len += n;
+    }
+    memcpy(msg, &argc, sizeof(int));
+    memcpy(msg + sizeof(int), &envc, sizeof(int));
+
+    int cwd_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwd_fd < 0) {
+        free(msg);
+        return -2;
+    }
+    int fds[4] = {in_fd, out_fd, err_fd, cwd_fd};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {msg, len};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(zygote_fd, &hdr, MSG_NOSIGNAL);
+    close(cwd_fd);
+    free(msg);
+    ZygoteEvent ev;
+    if (sent < 0 || wait_zygote_event(ZYGOTE_SPAWNED, 0, &ev) < 0) {
+        fprintf(stderr, "zygote unavailable, falling back to fork\n");
+        if (zygote_fd >= 0) close(zygote_fd);
+        zygote_fd = -1;
+        return -2;
+    }
+    if (ev.pid < 0) {
+        errno = ev.status;
+        perror("Fork failed");
+        return -1;
+    }
+    return ev.pid;
+
+too_big:
+    free(msg);
+    return -2;
+}
+
+int is_builtin(char* cmd);
+void handle_builtin(char** arglist);
+void run_cached(char** arglist);
+void run_on_change(char** arglist);
+
+int execute(char* arglist[], int is_background, const char* cmdline) {
+    if (arglist[0] == NULL) {
+        fprintf(stderr, "Error: empty command\n");
+        return -1;
+    }
+    if (is_builtin(arglist[0])) {
+        handle_builtin(arglist);
+        fflush(stdout);
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return -1;
+    } else if (pid == 0) {
+        execvp(arglist[0], arglist);
+        perror("Command execution failed");
+        exit(1);
+    } else {
+        if (!is_background) {
+            waitpid(pid, NULL, 0);
+        } else {
+            printf("[Background] Process started with PID %d\n", pid);
+            add_job(pid, cmdline);
+        }
+    }
+    return 0;
+}
+
+char* read_all(int fd, size_t* out_len) {
+    size_t cap = DIRENT_BUF_SIZE;
+    size_t len = 0;
+    char* buf = malloc(cap);
+    while (buf) {
+        if (cap - len < DIRENT_BUF_SIZE / 4) {
+            cap *= 2;
+            buf = realloc(buf, cap);
+            if (!buf) break;
+        }
+        ssize_t n = read(fd, buf + len, cap - len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        len += n;
+    }
+    if (!buf) {
+        fprintf(stderr, "Memory allocation error\n");
+        exit(1);
+    }
+    buf[len] = '\0';
+    *out_len = len;
+    return buf;
+}
+
+int write_all(int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+long arg_budget(char** prefix, int prefix_len) {
+    extern char** environ;
+    long budget = sysconf(_SC_ARG_MAX);
+    if (budget <= 0) budget = 131072;
+    budget -= ARG_HEADROOM;
+    for (char** e = environ; *e != NULL; e++) {
+        budget -= strlen(*e) + 1 + sizeof(char*);
+    }
+    for (int i = 0; i < prefix_len; i++) {
+        budget -= strlen(prefix[i]) + 1 + sizeof(char*);
+    }
+    return budget;
+}
+
+// Wait until one of the batch's own children exits and return 1 if it
+// failed. SIGCHLD is blocked by the caller and only taken with
+// sigwaitinfo(), so jobs, coprocs and the zygote are left for
+// handle_sigchld.
+int wait_batch_child(pid_t* running, int* nrunning) {
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    for (;;) {
+        for (int i = 0; i < *nrunning; i++) {
+            int status;
+            pid_t pid = waitpid(running[i], &status, WNOHANG);
+            if (pid == 0 || (pid < 0 && errno == EINTR)) continue;
+            running[i] = running[--(*nrunning)];
+            return pid < 0 || !(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+        // EINTR (e.g. SIGIO from output capture) just means another look
+        sigwaitinfo(&chld, NULL);
+    }
+}
+
+void run_batch(char** arglist) {
+    int parallel = 1;
+    int nul_separated = 0;
+    int i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && strcmp(arglist[i], "--") != 0; i++) {
+        if (strcmp(arglist[i], "-0") == 0) {
+            nul_separated = 1;
+        } else if (strcmp(arglist[i], "-P") == 0 && arglist[i + 1] != NULL) {
+            parallel = atoi(arglist[++i]);
+        } else {
+            break;
+        }
+    }
+    char** prefix = arglist + i;
+    int prefix_len = 0;
+    while (prefix[prefix_len] != NULL && strcmp(prefix[prefix_len], "--") != 0) prefix_len++;
+    if (prefix_len == 0 || parallel < 1) {
+        fprintf(stderr, "Usage: batch [-P <jobs>] [-0] <command> [args...] [-- <names...>]\n");
+        return;
+    }
+
+    char* input = NULL;
+    char** names;
+    int count = 0;
+    if (prefix[prefix_len] != NULL) {
+        names = prefix + prefix_len + 1;
+        while (names[count] != NULL) count++;
+    } else {
+        size_t len;
+        input = read_all(STDIN_FILENO, &len);
+        char sep = nul_separated ? '\0' : '\n';
+        int cap = 0;
+        for (size_t off = 0; off < len; off++) {
+            if (input[off] == sep) cap++;
+        }
+        names = malloc(sizeof(char*) * (cap + 1));
+        for (char *p = input, *end = input + len; p < end;) {
+            char* next = memchr(p, sep, end - p);
+            if (next == NULL) next = end;
+            *next = '\0';
+            if (next > p) names[count++] = p;
+            p = next + 1;
+        }
+    }
+    if (count == 0) {
+        free(input);
+        if (input) free(names);
+        return;
+    }
+
+    char** slots = malloc(sizeof(char*) * (prefix_len + count + 1));
+    memcpy(slots + prefix_len, names, sizeof(char*) * count);
+    slots[prefix_len + count] = NULL;
+    long budget = arg_budget(prefix, prefix_len);
+    pid_t* running = malloc(sizeof(pid_t) * parallel);
+    int nrunning = 0, batches = 0, failed = 0;
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    for (int start = 0; start < count;) {
+        int end = start;
+        long used = 0;
+        do {
+            used += strlen(names[end]) + 1 + sizeof(char*);
+            end++;
+        } while (end < count && used + (long)(strlen(names[end]) + 1 + sizeof(char*)) <= budget);
+
+        char** argv = slots + start;
+        memcpy(argv, prefix, sizeof(char*) * prefix_len);
+        char* saved = slots[prefix_len + end];
+        slots[prefix_len + end] = NULL;
+
+        if (nrunning == parallel) {
+            failed += wait_batch_child(running, &nrunning);
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            execvp(argv[0], argv);
+            perror("Command execution failed");
+            exit(1);
+        } else if (pid < 0) {
+            perror("Fork failed");
+            failed++;
+        } else {
+            running[nrunning++] = pid;
+        }
+        slots[prefix_len + end] = saved;
+        batches++;
+        start = end;
+    }
+    while (nrunning > 0) {
+        failed += wait_batch_child(running, &nrunning);
+    }
+    // SIGCHLDs taken by sigwaitinfo() may have been for other children
+    handle_sigchld(SIGCHLD);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (failed > 0) {
+        fprintf(stderr, "batch: %d of %d batches failed\n", failed, batches);
+    }
+    free(running);
+    free(slots);
+    if (input) {
+        free(names);
+        free(input);
+    }
+}
+
+long long monotonic_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Parse "5", "5s", "250ms", "2m" or "1h" into milliseconds
+long long parse_duration(const char* text) {
+    char* end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0) {
+        value *= 1000;
+    } else if (strcmp(end, "m") == 0) {
+        value *= 60000;
+    } else if (strcmp(end, "h") == 0) {
+        value *= 3600000;
+    } else if (strcmp(end, "ms") != 0) {
+        return -1;
+    }
+    return (long long)value;
+}
+
+int arm_timer(int tfd, long long ms) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000;
+    if (ms == 0) its.it_value.tv_nsec = 1;  // an all-zero value would disarm the timer
+    return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+int open_pidfd(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+// Collect the exit status of a job; zygote-launched jobs are reaped by the zygote
+int reap_job(pid_t pid) {
+    int status;
+    ZygoteEvent ev;
+    if (waitpid(pid, &status, WNOHANG) == pid) {
+        remove_job(pid);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    remove_job(pid);
+    if (errno == ECHILD && zygote_fd >= 0 && wait_zygote_event(ZYGOTE_EXITED, pid, &ev) == 0) {
+        return WIFEXITED(ev.status) ? WEXITSTATUS(ev.status) : 128 + WTERMSIG(ev.status);
+    }
+    return -1;
+}
+
+volatile sig_atomic_t interrupted = 0;
+
+void handle_interrupt(int sig) {
+    interrupted = 1;
+}
+
+// timeout [-k grace] <duration> cmd: poll a pidfd against a timerfd, no helper process.
+// The command runs in its own process group so the deadline also reaches
+// whatever it started; Ctrl-C is passed on to that group.
+void run_timeout(char** arglist) {
+    long long grace = TIMEOUT_GRACE_MS;
+    long long limit = -1;
+    int i = 1;
+    if (arglist[i] != NULL && strcmp(arglist[i], "-k") == 0 && arglist[i + 1] != NULL) {
+        grace = parse_duration(arglist[i + 1]);
+        i += 2;
+    }
+    if (arglist[i] == NULL || arglist[i + 1] == NULL || (limit = parse_duration(arglist[i])) < 0 || grace < 0) {
+        fprintf(stderr, "Usage: timeout [-k <grace>] <duration> <command> [args...]\n");
+        return;
+    }
+    char** argv = arglist + i + 1;
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return;
+    } else if (pid == 0) {
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        setpgid(0, 0);
+        execvp(argv[0], argv);
+        perror("Command execution failed");
+        exit(127);
+    }
+    setpgid(pid, pid);
+
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &sa, &old_sa);
+    interrupted = 0;
+
+    int pidfd = open_pidfd(pid);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (pidfd < 0 || tfd < 0 || arm_timer(tfd, limit) < 0) {
+        perror("timeout: cannot set deadline");
+    } else {
+        int stage = 0;
+        for (;;) {
+            struct pollfd pfds[2] = {{pidfd, POLLIN, 0}, {tfd, POLLIN, 0}};
+            if (poll(pfds, 2, -1) < 0) {
+                if (errno != EINTR) break;
+                if (interrupted) {
+                    kill(-pid, SIGINT);
+                    interrupted = 0;
+                }
+                continue;
+            }
+            if (pfds[0].revents) break;
+            if (pfds[1].revents) {
+                uint64_t expirations;
+                read(tfd, &expirations, sizeof(expirations));
+                if (stage == 0) {
+                    kill(-pid, SIGTERM);
+                    arm_timer(tfd, grace);
+                } else {
+                    kill(-pid, SIGKILL);
+                }
+                stage++;
+            }
+        }
+        if (stage > 0) {
+            // Nothing the command started may outlive its deadline
+            kill(-pid, SIGKILL);
+            fprintf(stderr, "timeout: %s %s after %s\n", argv[0], stage == 1 ? "terminated" : "killed", arglist[i]);
+        }
+    }
+    waitpid(pid, NULL, 0);
+    sigaction(SIGINT, &old_sa, NULL);
+    if (pidfd >= 0) close(pidfd);
+    if (tfd >= 0) close(tfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+// wait [-n] [--timeout <duration>] [pid...]: block on pidfds of background jobs
+void run_wait(char** arglist) {
+    int any = 0;
+    long long limit = -1;
+    int i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-'; i++) {
+        if (strcmp(arglist[i], "-n") == 0) {
+            any = 1;
+        } else if (strcmp(arglist[i], "--timeout") == 0 && arglist[i + 1] != NULL &&
+                   (limit = parse_duration(arglist[i + 1])) >= 0) {
+            i++;
+        } else {
+            fprintf(stderr, "Usage: wait [-n] [--timeout <duration>] [pid...]\n");
+            return;
+        }
+    }
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    drain_zygote_events();
+
+    struct pollfd pfds[MAX_JOBS + 1];
+    int job_index[MAX_JOBS];
+    int count = 0;
+    for (int j = 0; j < job_count; j++) {
+        if (!jobs[j].active) continue;
+        int wanted = arglist[i] == NULL;
+        for (int k = i; arglist[k] != NULL && !wanted; k++) {
+            wanted = atoi(arglist[k]) == jobs[j].pid;
+        }
+        if (!wanted) continue;
+        int fd = open_pidfd(jobs[j].pid);
+        if (fd < 0) {
+            // Already gone; let the SIGCHLD handler or zygote event retire it
+            continue;
+        }
+        pfds[count].fd = fd;
+        pfds[count].events = POLLIN;
+        job_index[count++] = j;
+    }
+
+    int tfd = -1;
+    if (limit >= 0 && count > 0) {
+        tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tfd >= 0) arm_timer(tfd, limit);
+    }
+    pfds[count].fd = tfd;
+    pfds[count].events = POLLIN;
+
+    int remaining = count;
+    while (remaining > 0) {
+        if (poll(pfds, count + 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("wait: poll failed");
+            break;
+        }
+        if (pfds[count].revents) {
+            fprintf(stderr, "wait: timed out with %d job(s) still running\n", remaining);
+            break;
+        }
+        int finished = 0;
+        for (int k = 0; k < count; k++) {
+            if (pfds[k].fd < 0 || !pfds[k].revents) continue;
+            Job* job = &jobs[job_index[k]];
+            int status = reap_job(job->pid);
+            printf("[%d] Done PID: %d, Command: %s, Status: %d\n", job_index[k] + 1, job->pid, job->cmdline, status);
+            close(pfds[k].fd);
+            pfds[k].fd = -1;
+            remaining--;
+            finished++;
+        }
+        if (any && finished > 0) break;
+    }
+
+    for (int k = 0; k < count; k++) {
+        if (pfds[k].fd >= 0) close(pfds[k].fd);
+    }
+    if (tfd >= 0) close(tfd);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+int capture_jobs = 0;
+size_t capture_limit = JOB_CAPTURE_MEM;
+size_t capture_used = 0;
+
+// Pull whatever a captured job has written into its ring (or spill file).
+// Runs from the SIGIO handler, so it sticks to read/write
+void drain_job(Job* job) {
+    char spill_buf[4096];
+    while (job->out_fd >= 0) {
+        char* dst = spill_buf;
+        size_t room = sizeof(spill_buf);
+        if (job->spill_fd < 0 && job->ring != NULL) {
+            size_t pos = job->ring_total % job->ring_size;
+            dst = job->ring + pos;
+            room = job->ring_size - pos;
+        }
+        ssize_t n = read(job->out_fd, dst, room);
+        if (n > 0) {
+            if (job->spill_fd >= 0) write(job->spill_fd, dst, n);
+            job->ring_total += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (n == 0 || errno != EAGAIN) {
+                close(job->out_fd);
+                job->out_fd = -1;
+            }
+            break;
+        }
+    }
+}
+
+void handle_sigio(int sig) {
+    int saved_errno = errno;
+    for (int i = 0; i < job_count; i++) {
+        drain_job(&jobs[i]);
+    }
+    errno = saved_errno;
+}
+
+void block_sigio(sigset_t* old_mask) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGIO);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+void release_job_ring(Job* job) {
+    free(job->ring);
+    job->ring = NULL;
+    capture_used -= job->ring_size;
+    job->ring_size = 0;
+}
+
+// Reserve a ring under the global ceiling, evicting finished jobs' output first
+size_t reserve_job_ring() {
+    size_t size = JOB_RING_SIZE;
+    for (int i = 0; i < job_count && capture_used + size > capture_limit; i++) {
+        if (!jobs[i].active && jobs[i].out_fd < 0 && jobs[i].ring != NULL) {
+            release_job_ring(&jobs[i]);
+        }
+    }
+    if (capture_used + size > capture_limit) {
+        size = capture_limit > capture_used ? capture_limit - capture_used : 0;
+    }
+    return size >= JOB_RING_MIN ? size : 0;
+}
+
+// Attach the read end of a background job's output pipe; SIGIO then drains it
+void attach_job_output(Job* job, int fd, size_t size) {
+    job->ring = malloc(size);
+    if (job->ring == NULL) {
+        close(fd);
+        return;
+    }
+    job->ring_size = size;
+    capture_used += size;
+    fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETFL, O_NONBLOCK | O_ASYNC);
+    job->out_fd = fd;
+    drain_job(job);
+}
+
+// Write ring bytes from absolute offset `from` up to ring_total
+unsigned long long print_job_output(Job* job, unsigned long long from) {
+    if (job->ring == NULL) return job->ring_total;
+    unsigned long long oldest = job->ring_total > job->ring_size ? job->ring_total - job->ring_size : 0;
+    if (from < oldest) {
+        fprintf(stderr, "[... %llu bytes dropped]\n", oldest - from);
+        from = oldest;
+    }
+    fflush(stdout);
+    while (from < job->ring_total) {
+        size_t pos = from % job->ring_size;
+        size_t n = job->ring_size - pos;
+        if (n > job->ring_total - from) n = job->ring_total - from;
+        write_all(STDOUT_FILENO, job->ring + pos, n);
+        from += n;
+    }
+    return from;
+}
+
+void follow_job_output(Job* job) {
+    sigset_t old_mask;
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &sa, &old_sa);
+    interrupted = 0;
+
+    block_sigio(&old_mask);
+    drain_job(job);
+    unsigned long long pos = print_job_output(job, 0);
+    while (job->out_fd >= 0 && !interrupted) {
+        struct pollfd pfd = {job->out_fd, POLLIN, 0};
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) break;
+        drain_job(job);
+        pos = print_job_output(job, pos);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    sigaction(SIGINT, &old_sa, NULL);
+}
+
+void spill_job_output(Job* job, const char* path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror("jobs: cannot open spill file");
+        return;
+    }
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(fd, STDOUT_FILENO);
+    print_job_output(job, 0);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (job->spill_fd >= 0) close(job->spill_fd);
+    job->spill_fd = fd;
+    release_job_ring(job);
+}
+
+typedef struct {
+    pid_t pid;
+    int job;        // index into jobs[]
+    int stat_fd;    // /proc/<pid>/stat, statm, io and children stay open and are re-read with pread
+    int statm_fd;
+    int io_fd;
+    int children_fd;
+    unsigned long long ticks, rchar, wchar;
+    double cpu, read_rate, write_rate;
+    long rss_pages;
+    char state;
+    int seen;
+} ProcSample;
+
+ProcSample* samples = NULL;
+int sample_count = 0;
+int sample_cap = 0;
+
+ssize_t pread_text(int fd, char* buf, size_t size) {
+    if (fd < 0) return -1;
+    ssize_t n = pread(fd, buf, size - 1, 0);
+    buf[n > 0 ? n : 0] = '\0';
+    return n;
+}
+
+int open_proc_file(pid_t pid, const char* name) {
+    char path[96];
+    snprintf(path, sizeof(path), "/proc/%d/%s", pid, name);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+ProcSample* find_sample(pid_t pid, int job) {
+    for (int i = 0; i < sample_count; i++) {
+        if (samples[i].pid == pid) return &samples[i];
+    }
+    int stat_fd = open_proc_file(pid, "stat");
+    if (stat_fd < 0) return NULL;
+    if (sample_count == sample_cap) {
+        sample_cap = sample_cap ? sample_cap * 2 : 16;
+        samples = realloc(samples, sizeof(ProcSample) * sample_cap);
+    }
+    ProcSample* sample = &samples[sample_count++];
+    char children[32];
+    snprintf(children, sizeof(children), "task/%d/children", pid);
+    memset(sample, 0, sizeof(*sample));
+    sample->pid = pid;
+    sample->job = job;
+    sample->stat_fd = stat_fd;
+    sample->statm_fd = open_proc_file(pid, "statm");
+    sample->io_fd = open_proc_file(pid, "io");
+    sample->children_fd = open_proc_file(pid, children);
+    sample->ticks = (unsigned long long)-1;
+    return sample;
+}
+
+void close_sample(ProcSample* sample) {
+    close(sample->stat_fd);
+    if (sample->statm_fd >= 0) close(sample->statm_fd);
+    if (sample->io_fd >= 0) close(sample->io_fd);
+    if (sample->children_fd >= 0) close(sample->children_fd);
+}
+
+unsigned long long io_field(const char* text, const char* key) {
+    const char* p = strstr(text, key);
+    return p ? strtoull(p + strlen(key), NULL, 10) : 0;
+}
+
+// Take one sample of pid and recurse into its children; rates are per elapsed_ms
+void sample_process(pid_t pid, int job, long long elapsed_ms, int depth) {
+    ProcSample* sample = find_sample(pid, job);
+    char buf[4096];
+    if (sample == NULL || sample->seen || pread_text(sample->stat_fd, buf, sizeof(buf)) <= 0) return;
+    sample->seen = 1;
+
+    // Fields after the last ')' start at field 3 (state); utime and stime are fields 14 and 15
+    char* p = strrchr(buf, ')');
+    if (p == NULL) return;
+    unsigned long long utime = 0, stime = 0;
+    sscanf(p + 2, "%c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &sample->state, &utime, &stime);
+    long hz = sysconf(_SC_CLK_TCK);
+    if (sample->ticks != (unsigned long long)-1 && elapsed_ms > 0) {
+        sample->cpu = (utime + stime - sample->ticks) * 100000.0 / (hz * elapsed_ms);
+    }
+    sample->ticks = utime + stime;
+
+    if (pread_text(sample->statm_fd, buf, sizeof(buf)) > 0) {
+        sscanf(buf, "%*d %ld", &sample->rss_pages);
+    }
+    if (pread_text(sample->io_fd, buf, sizeof(buf)) > 0) {
+        unsigned long long rchar = io_field(buf, "rchar: "), wchar = io_field(buf, "wchar: ");
+        if (elapsed_ms > 0 && sample->rchar + sample->wchar > 0) {
+            sample->read_rate = (rchar - sample->rchar) * 1000.0 / elapsed_ms;
+            sample->write_rate = (wchar - sample->wchar) * 1000.0 / elapsed_ms;
+        }
+        sample->rchar = rchar;
+        sample->wchar = wchar;
+    }
+
+    if (depth < 32 && pread_text(sample->children_fd, buf, sizeof(buf)) > 0) {
+        char* save;
+        char* list = strdup(buf);
+        for (char* tok = strtok_r(list, " \n", &save); tok != NULL; tok = strtok_r(NULL, " \n", &save)) {
+            sample_process(atoi(tok), job, elapsed_ms, depth + 1);
+        }
+        free(list);
+    }
+}
+
+// Sample every active job's process tree, dropping processes that have gone away
+void sample_jobs(long long elapsed_ms) {
+    for (int i = 0; i < sample_count; i++) samples[i].seen = 0;
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].active) sample_process(jobs[i].pid, i, elapsed_ms, 0);
+    }
+    int kept = 0;
+    for (int i = 0; i < sample_count; i++) {
+        if (samples[i].seen) {
+            samples[kept++] = samples[i];
+        } else {
+            close_sample(&samples[i]);
+        }
+    }
+    sample_count = kept;
+}
+
+void format_bytes(double bytes, char* out, size_t size) {
+    const char* units[] = {"B", "K", "M", "G", "T"};
+    int u = 0;
+    while (bytes >= 1024 && u < 4) {
+        bytes /= 1024;
+        u++;
+    }
+    snprintf(out, size, u == 0 ? "%.0f%s" : "%.1f%s", bytes, units[u]);
+}
+
+void print_job_monitor(long long interval) {
+    long page = sysconf(_SC_PAGESIZE);
+    printf("\033[H\033[2J");
+    printf("Jobs (every %lldms, Ctrl-C to stop)\n", interval);
+    printf("%-4s %-8s %-5s %3s %7s %8s %9s %9s  %s\n", "JOB", "PID", "STATE", "NP", "CPU%", "RSS", "READ/s",
+           "WRITE/s", "COMMAND");
+    for (int i = 0; i < job_count; i++) {
+        if (!jobs[i].active) continue;
+        int nproc = 0;
+        char state = '?';
+        double cpu = 0, rss = 0, rd = 0, wr = 0;
+        for (int k = 0; k < sample_count; k++) {
+            if (samples[k].job != i) continue;
+            if (samples[k].pid == jobs[i].pid) state = samples[k].state;
+            nproc++;
+            cpu += samples[k].cpu;
+            rss += (double)samples[k].rss_pages * page;
+            rd += samples[k].read_rate;
+            wr += samples[k].write_rate;
+        }
+        char label[16], rss_text[16], rd_text[16], wr_text[16];
+        snprintf(label, sizeof(label), "[%d]", i + 1);
+        format_bytes(rss, rss_text, sizeof(rss_text));
+        format_bytes(rd, rd_text, sizeof(rd_text));
+        format_bytes(wr, wr_text, sizeof(wr_text));
+        printf("%-4s %-8d %-5c %3d %7.1f %8s %9s %9s  %s\n", label, jobs[i].pid, state, nproc, cpu, rss_text,
+               rd_text, wr_text, jobs[i].cmdline);
+    }
+    fflush(stdout);
+}
+
+void watch_jobs(long long interval) {
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &sa, &old_sa);
+    interrupted = 0;
+
+    long long last = monotonic_ms();
+    sample_jobs(0);
+    while (!interrupted) {
+        // SIGCHLD and SIGIO cut poll() short; sleep out the rest of the
+        // interval so redraws and CPU deltas keep to it
+        long long deadline = last + interval;
+        long long now = monotonic_ms();
+        while (!interrupted && now < deadline) {
+            poll(NULL, 0, deadline - now);
+            now = monotonic_ms();
+        }
+        if (interrupted) break;
+        sample_jobs(now - last);
+        last = now;
+        print_job_monitor(interval);
+        if (sample_count == 0) break;
+    }
+
+    for (int i = 0; i < sample_count; i++) close_sample(&samples[i]);
+    sample_count = 0;
+    sigaction(SIGINT, &old_sa, NULL);
+}
+
+// jobs [-o N | -f N | -s N FILE | --watch [INTERVAL] | --capture on|off | --capture-mem SIZE]
+void handle_jobs(char** arglist) {
+    if (arglist[1] == NULL) {
+        sigset_t old_mask;
+        block_sigio(&old_mask);
+        list_jobs();
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        return;
+    }
+    if (strcmp(arglist[1], "--watch") == 0) {
+        long long interval = arglist[2] ? parse_duration(arglist[2]) : WATCH_INTERVAL_MS;
+        if (interval <= 0) {
+            fprintf(stderr, "Usage: jobs --watch [interval]\n");
+            return;
+        }
+        watch_jobs(interval);
+        return;
+    }
+    if (strcmp(arglist[1], "--capture") == 0 && arglist[2] != NULL) {
+        capture_jobs = strcmp(arglist[2], "on") == 0;
+        return;
+    }
+    if (strcmp(arglist[1], "--capture-mem") == 0 && arglist[2] != NULL && parse_size(arglist[2]) > 0) {
+        capture_limit = parse_size(arglist[2]);
+        return;
+    }
+
+    int job_num = arglist[2] ? atoi(arglist[2]) : 0;
+    if (job_num <= 0 || job_num > job_count ||
+        (jobs[job_num - 1].ring == NULL && jobs[job_num - 1].out_fd < 0)) {
+        fprintf(stderr, "Usage: jobs [-o|-f <job_num>] [-s <job_num> <file>] [--capture on|off] "
+                        "[--capture-mem <size>]\n");
+        return;
+    }
+    Job* job = &jobs[job_num - 1];
+    if (strcmp(arglist[1], "-f") == 0) {
+        follow_job_output(job);
+        return;
+    }
+    sigset_t old_mask;
+    block_sigio(&old_mask);
+    drain_job(job);
+    if (strcmp(arglist[1], "-o") == 0) {
+        print_job_output(job, 0);
+    } else if (strcmp(arglist[1], "-s") == 0 && arglist[3] != NULL) {
+        spill_job_output(job, arglist[3]);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+}
+
+const char* builtin_names[] = {"cd",    "exit",      "jobs",    "kill", "help", "coproc", "batch",
+                               "cache", "on-change", "timeout", "wait", NULL};
+
+int is_builtin(char* cmd) {
+    for (int i = 0; builtin_names[i] != NULL; i++) {
+        if (strcmp(cmd, builtin_names[i]) == 0) return 1;
+    }
+    return 0;
+}
+
+void handle_builtin(char** arglist) {
+    if (strcmp(arglist[0], "cd") == 0) {
+        if (arglist[1] == NULL || chdir(arglist[1]) != 0) {
+            perror("cd failed");
+        }
+    } else if (strcmp(arglist[0], "exit") == 0) {
+        printf("Exiting PUCITshell\n");
+        for (int i = 0; i < MAX_COPROCS; i++) {
+            if (coprocs[i].active) stop_coproc(&coprocs[i]);
+        }
+        exit(0);
+    } else if (strcmp(arglist[0], "jobs") == 0) {
+        drain_zygote_events();
+        handle_jobs(arglist);
+    } else if (strcmp(arglist[0], "kill") == 0) {
+        if (arglist[1] == NULL) {
+            fprintf(stderr, "Usage: kill <job_number>\n");
+            return;
+        }
+        int job_num = atoi(arglist[1]);
+        if (job_num <= 0 || job_num > job_count || !jobs[job_num - 1].active) {
+            fprintf(stderr, "Invalid job number\n");
+        } else {
+            kill(jobs[job_num - 1].pid, SIGKILL);
+            jobs[job_num - 1].active = 0;
+        }
+    } else if (strcmp(arglist[0], "coproc") == 0) {
+        handle_coproc(arglist);
+    } else if (strcmp(arglist[0], "batch") == 0) {
+        run_batch(arglist);
+    } else if (strcmp(arglist[0], "cache") == 0) {
+        run_cached(arglist);
+    } else if (strcmp(arglist[0], "on-change") == 0) {
+        run_on_change(arglist);
+    } else if (strcmp(arglist[0], "timeout") == 0) {
+        run_timeout(arglist);
+    } else if (strcmp(arglist[0], "wait") == 0) {
+        run_wait(arglist);
+    } else if (strcmp(arglist[0], "help") == 0) {
+        printf("PUCITshell Built-in Commands:\n");
+        printf("cd <directory> : Change the working directory\n");
+        printf("exit           : Exit the shell\n");
+        printf("jobs           : List background jobs\n");
+        printf("jobs --watch [interval]      : Live CPU, memory and I/O of jobs and their children\n");
+        printf("jobs -o|-f <job_num>         : Show or follow a job's captured output\n");
+        printf("jobs -s <job_num> <file>     : Move a job's captured output to a file\n");
+        printf("jobs --capture on|off        : Capture output of new background jobs\n");
+        printf("jobs --capture-mem <size>    : Memory ceiling for captured output\n");
+        printf("kill <job_num> : Kill a background job\n");
+        printf("help           : Show this help message\n");
+        printf("batch [-P N] [-0] <cmd> [-- names] : Run cmd with names from stdin, packed up to ARG_MAX\n");
+        printf("cache [-v] <cmd> | cache --clear   : Replay stored output of a deterministic command\n");
+        printf("wait [-n] [--timeout <dur>] [pid]  : Wait for background jobs (any one with -n)\n");
+        printf("timeout [-k <grace>] <dur> <cmd>   : Run a command with a deadline, SIGTERM then SIGKILL\n");
+        printf("on-change [-r] <paths> -- <cmd>    : Rerun a command whenever the paths change\n");
+        printf("on [cpus=LIST] [node=LIST] <cmd>   : Run a command on the given CPUs / NUMA nodes\n");
+        printf("on --pipeline pack|off|cpus=...    : Set the placement policy for pipeline stages\n");
+        printf("limit [--cpu N] [--mem SIZE] [--io MAJ:MIN,KEY=VAL] <cmd> : Run a command in its own cgroup\n");
+        printf("coproc [-r] <name> <cmd> : Start a coprocess (-r restarts it on exit)\n");
+        printf("coproc write <name> <text> : Send a line to a coprocess\n");
+        printf("coproc read <name>         : Read a line from a coprocess\n");
+        printf("coproc stop <name>         : Stop a coprocess\n");
+    }
+}
+
+typedef struct {
+    char* path;
+    char* buf;     // kept dirent64 records
+    size_t len;
+    size_t cap;
+    char** names;
+    unsigned char* types;
+    int count;
+    int fd;        // open while entries remain to be read
+    int complete;  // 0 when a scan stopped early at a read or match limit
+} DirListing;
+
+DirListing** dir_cache = NULL;
+int dir_cache_count = 0;
+int dir_cache_cap = 0;
+
+typedef struct {
+    char** paths;
+    int count;
+    int cap;
+} PathList;
+
+void path_list_push(PathList* list, char* path) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 16;
+        list->paths = realloc(list->paths, sizeof(char*) * list->cap);
+        if (!list->paths) {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+    }
+    list->paths[list->count++] = path;
+}
+
+// Whether a directory entry belongs in a scan for prefix; an empty prefix
+// leaves out dot files, as completion does
+int scan_matches(const char* name, const char* prefix) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return 0;
+    if (prefix == NULL) return 1;
+    if (prefix[0] == '\0') return name[0] != '.';
+    return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+// Read up to max_bytes of getdents64 records (all when 0) into listing,
+// keeping those that match prefix, and stop early once max_matches (if > 0)
+// are kept. The directory offset stays with listing->fd, so a later call
+// continues where this one stopped.
+void continue_listing(DirListing* listing, const char* prefix, size_t max_bytes, int max_matches) {
+    char chunk[DIRENT_BUF_SIZE];
+    size_t consumed = 0;
+    while (listing->fd >= 0 && (max_bytes == 0 || consumed < max_bytes) &&
+           (max_matches <= 0 || listing->count < max_matches)) {
+        ssize_t n = getdents64(listing->fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            listing->complete = n == 0;
+            close(listing->fd);
+            listing->fd = -1;
+            break;
+        }
+        consumed += n;
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64* d = (struct dirent64*)(chunk + off);
+            off += d->d_reclen;
+            if (!scan_matches(d->d_name, prefix)) continue;
+            if (listing->len + d->d_reclen > listing->cap) {
+                listing->cap = listing->cap ? listing->cap * 2 : DIRENT_BUF_SIZE;
+                listing->buf = realloc(listing->buf, listing->cap);
+                if (!listing->buf) {
+                    fprintf(stderr, "Memory allocation error\n");
+                    exit(1);
+                }
+            }
+            memcpy(listing->buf + listing->len, d, d->d_reclen);
+            listing->len += d->d_reclen;
+            listing->count++;
+        }
+    }
+
+    // The buffer may have moved, so the name pointers are rebuilt
+    listing->names = realloc(listing->names, sizeof(char*) * (listing->count + 1));
+    listing->types = realloc(listing->types, listing->count + 1);
+    int i = 0;
+    for (size_t off = 0; off < listing->len; i++) {
+        struct dirent64* d = (struct dirent64*)(listing->buf + off);
+        off += d->d_reclen;
+        listing->names[i] = d->d_name;
+        listing->types[i] = d->d_type;
+    }
+}
+
+// Uncached getdents64 listing of the entries matching prefix (all entries
+// when prefix is NULL), read as far as continue_listing() allows. Callers
+// own the result and release it with free_listing()
+DirListing* scan_directory(const char* dir, const char* prefix, size_t max_bytes, int max_matches) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    DirListing* listing = calloc(1, sizeof(DirListing));
+    listing->path = strdup(dir);
+    listing->fd = fd;
+    continue_listing(listing, prefix, max_bytes, max_matches);
+    return listing;
+}
+
+DirListing* read_directory(const char* dir) {
+    return scan_directory(dir, NULL, 0, 0);
+}
+
+void free_listing(DirListing* listing) {
+    if (listing->fd >= 0) close(listing->fd);
+    free(listing->path);
+    free(listing->buf);
+    free(listing->names);
+    free(listing->types);
+    free(listing);
+}
+
+DirListing* list_directory(const char* path) {
+    const char* dir = path[0] ? path : ".";
+    for (int i = 0; i < dir_cache_count; i++) {
+        if (strcmp(dir_cache[i]->path, dir) == 0) {
+            return dir_cache[i];
+        }
+    }
+
+    DirListing* listing = read_directory(dir);
+    if (!listing) {
+        return NULL;
+    }
+    if (dir_cache_count == dir_cache_cap) {
+        dir_cache_cap = dir_cache_cap ? dir_cache_cap * 2 : 16;
+        dir_cache = realloc(dir_cache, sizeof(DirListing*) * dir_cache_cap);
+    }
+    dir_cache[dir_cache_count++] = listing;
+    return listing;
+}
+
+void clear_dir_cache() {
+    for (int i = 0; i < dir_cache_count; i++) {
+        free_listing(dir_cache[i]);
+    }
+    dir_cache_count = 0;
+}
+
+char* join_path(const char* base, const char* name) {
+    size_t base_len = strlen(base);
+    char* path = malloc(base_len + strlen(name) + 2);
+    if (base_len == 0) {
+        strcpy(path, name);
+    } else if (base[base_len - 1] == '/') {
+        sprintf(path, "%s%s", base, name);
+    } else {
+        sprintf(path, "%s/%s", base, name);
+    }
+    return path;
+}
+
+int is_directory(const char* path, unsigned char type, int follow_links) {
+    struct stat st;
+    if (type == DT_DIR) return 1;
+    if (type == DT_UNKNOWN || (type == DT_LNK && follow_links)) {
+        return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    return 0;
+}
+
+void glob_walk(const char* base, char** comps, int ncomps, int idx, PathList* out) {
+    struct stat st;
+    const char* comp = comps[idx];
+    int last = idx == ncomps - 1;
+
+    if (strpbrk(comp, "*?[") == NULL) {
+        char* path = join_path(base, comp);
+        if (!last) {
+            glob_walk(path, comps, ncomps, idx + 1, out);
+            free(path);
+        } else if (lstat(path, &st) == 0) {
+            path_list_push(out, path);
+        } else {
+            free(path);
+        }
+        return;
+    }
+
+    if (strcmp(comp, "**") == 0) {
+        if (last) {
+            comps[idx] = "*";
+            glob_walk(base, comps, ncomps, idx, out);
+            comps[idx] = "**";
+        } else {
+            glob_walk(base, comps, ncomps, idx + 1, out);
+        }
+    }
+
+    DirListing* listing = list_directory(base);
+    if (!listing) return;
+    for (int i = 0; i < listing->count; i++) {
+        const char* name = listing->names[i];
+        if (strcmp(comp, "**") == 0) {
+            if (name[0] == '.') continue;
+            char* path = join_path(base, name);
+            if (is_directory(path, listing->types[i], 0)) {
+                glob_walk(path, comps, ncomps, idx, out);
+            }
+            free(path);
+        } else if (fnmatch(comp, name, FNM_PERIOD) == 0) {
+            char* path = join_path(base, name);
+            if (last) {
+                path_list_push(out, path);
+                continue;
+            }
+            if (is_directory(path, listing->types[i], 1)) {
+                glob_walk(path, comps, ncomps, idx + 1, out);
+            }
+            free(path);
+        }
+    }
+}
+
+void radix_sort_strings(char** a, char** tmp, int n, int depth) {
+    if (n < RADIX_CUTOFF) {
+        for (int i = 1; i < n; i++) {
+            char* key = a[i];
+            int j = i - 1;
+            while (j >= 0 && strcmp(a[j] + depth, key + depth) > 0) {
+                a[j + 1] = a[j];
+                j--;
+            }
+            a[j + 1] = key;
+        }
+        return;
+    }
+
+    int counts[257] = {0};
+    int starts[257];
+    for (int i = 0; i < n; i++) {
+        counts[(unsigned char)a[i][depth]]++;
+    }
+    starts[0] = 0;
+    for (int b = 1; b < 257; b++) {
+        starts[b] = starts[b - 1] + counts[b - 1];
+    }
+    for (int i = 0; i < n; i++) {
+        tmp[starts[(unsigned char)a[i][depth]]++] = a[i];
+    }
+    memcpy(a, tmp, sizeof(char*) * n);
+
+    int start = counts[0];
+    for (int b = 1; b < 256; b++) {
+        if (counts[b] > 1) {
+            radix_sort_strings(a + start, tmp, counts[b], depth + 1);
+        }
+        start += counts[b];
+    }
+}
+
+int expand_glob(const char* pattern, PathList* out) {
+    int dir_only = pattern[strlen(pattern) - 1] == '/';
+    char* copy = strdup(pattern);
+    char* comps[MAX_LEN / 2];
+    int ncomps = 0;
+    for (char* c = strtok(copy, "/"); c != NULL && ncomps < MAX_LEN / 2; c = strtok(NULL, "/")) {
+        comps[ncomps++] = c;
+    }
+
+    int first = out->count;
+    if (ncomps > 0) {
+        glob_walk(pattern[0] == '/' ? "/" : "", comps, ncomps, 0, out);
+    }
+    free(copy);
+
+    if (dir_only) {
+        int kept = first;
+        for (int i = first; i < out->count; i++) {
+            char* path = out->paths[i];
+            if (is_directory(path, DT_UNKNOWN, 1)) {
+                out->paths[kept] = join_path(path, "");
+                kept++;
+            }
+            free(path);
+        }
+        out->count = kept;
+    }
+
+    int matched = out->count - first;
+    if (matched > 1) {
+        char** tmp = malloc(sizeof(char*) * matched);
+        radix_sort_strings(out->paths + first, tmp, matched, 0);
+        free(tmp);
+    }
+    return matched;
+}
+
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+uint64_t xxh64_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh64_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = xxh64_round(v1, read64(p));
+            v2 = xxh64_round(v2, read64(p + 8));
+            v3 = xxh64_round(v3, read64(p + 16));
+            v4 = xxh64_round(v4, read64(p + 24));
+        }
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh64_merge(h, v1);
+        h = xxh64_merge(h, v2);
+        h = xxh64_merge(h, v3);
+        h = xxh64_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += len;
+    for (; p + 8 <= end; p += 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (p + 4 <= end) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        h ^= k * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+    }
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+void hash128(const void* data, size_t len, uint64_t out[2]) {
+    out[0] = xxh64(data, len, 0);
+    out[1] = xxh64(data, len, XXH_P3);
+}
+
+struct stat shell_stdin;
+
+typedef struct {
+    uint32_t magic;
+    int32_t status;
+    uint64_t out_len;
+    uint64_t err_len;
+} CacheHeader;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    struct timespec ctime;
+    uint64_t hash[2];
+    char path[MAX_LEN];
+} FileMemo;
+
+void append_bytes(char** buf, size_t* len, size_t* cap, const void* data, size_t n) {
+    if (*len + n > *cap) {
+        *cap = (*len + n) * 2;
+        *buf = realloc(*buf, *cap);
+        if (!*buf) {
+            fprintf(stderr, "Memory allocation error\n");
+            exit(1);
+        }
+    }
+    memcpy(*buf + *len, data, n);
+    *len += n;
+}
+
+int mkdir_p(char* path) {
+    for (char* p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            mkdir(path, 0700);
+            *p = '/';
+        }
+    }
+    return mkdir(path, 0700) == 0 || errno == EEXIST ? 0 : -1;
+}
+
+// Cache directory, or NULL without a home directory to put it in: a shared
+// fallback such as /tmp would let another user plant entries
+const char* cache_dir() {
+    static char dir[MAX_LEN * 2] = "";
+    if (dir[0] != '\0') return dir;
+    const char* base = getenv("SHELL_CACHE_DIR");
+    struct passwd* pw;
+    if (base) {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) != NULL) {
+        snprintf(dir, sizeof(dir), "%s/elevenshell", base);
+    } else if ((base = getenv("HOME")) != NULL || ((pw = getpwuid(getuid())) != NULL && (base = pw->pw_dir) != NULL)) {
+        snprintf(dir, sizeof(dir), "%s/.cache/elevenshell", base);
+    } else {
+        fprintf(stderr, "cache: no home directory for the cache\n");
+        return NULL;
+    }
+    char files[MAX_LEN * 2 + 8];
+    snprintf(files, sizeof(files), "%s/files", dir);
+    if (mkdir_p(files) < 0) {
+        perror("cache: cannot create cache directory");
+    }
+    return dir;
+}
+
+// Content hash of a file, memoized on (dev, inode, size, mtime, ctime) so an
+// unchanged input costs a stat and a small read instead of a full rehash
+int file_content_hash(const char* path, const struct stat* st, uint64_t out[2]) {
+    char memo_path[MAX_LEN * 3];
+    const char* dir = cache_dir();
+    if (dir == NULL) return -1;
+    uint64_t name_hash = xxh64(path, strlen(path), 0);
+    snprintf(memo_path, sizeof(memo_path), "%s/files/%016llx", dir, (unsigned long long)name_hash);
+
+    FileMemo memo;
+    int fd = open(memo_path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        ssize_t n = read(fd, &memo, sizeof(memo));
+        close(fd);
+        if (n == sizeof(memo) && memo.dev == st->st_dev && memo.ino == st->st_ino && memo.size == st->st_size &&
+            memo.mtime.tv_sec == st->st_mtim.tv_sec && memo.mtime.tv_nsec == st->st_mtim.tv_nsec &&
+            memo.ctime.tv_sec == st->st_ctim.tv_sec && memo.ctime.tv_nsec == st->st_ctim.tv_nsec &&
+            strncmp(memo.path, path, sizeof(memo.path)) == 0) {
+            out[0] = memo.hash[0];
+            out[1] = memo.hash[1];
+            return 0;
+        }
+    }
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    if (st->st_size == 0) {
+        hash128("", 0, out);
+    } else {
+        void* data = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return -1;
+        }
+        hash128(data, st->st_size, out);
+        munmap(data, st->st_size);
+    }
+    close(fd);
+
+    memset(&memo, 0, sizeof(memo));
+    memo.dev = st->st_dev;
+    memo.ino = st->st_ino;
+    memo.size = st->st_size;
+    memo.mtime = st->st_mtim;
+    memo.ctime = st->st_ctim;
+    memo.hash[0] = out[0];
+    memo.hash[1] = out[1];
+    strncpy(memo.path, path, sizeof(memo.path) - 1);
+    fd = open(memo_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        write(fd, &memo, sizeof(memo));
+        close(fd);
+    }
+    return 0;
+}
+
+void append_stat_fields(char** key, size_t* len, size_t* cap, const struct stat* st) {
+    append_bytes(key, len, cap, &st->st_dev, sizeof(st->st_dev));
+    append_bytes(key, len, cap, &st->st_ino, sizeof(st->st_ino));
+    append_bytes(key, len, cap, &st->st_size, sizeof(st->st_size));
+    append_bytes(key, len, cap, &st->st_mtim, sizeof(st->st_mtim));
+}
+
+// Key = argv, cwd, selected env, the executable's identity, the contents of
+// every argument that names a regular file, directory identities and stdin
+void cache_key(char** argv, const char* input, size_t input_len, uint64_t key_hash[2]) {
+    char* key = NULL;
+    size_t len = 0, cap = 0;
+    struct stat st;
+    char cwd[MAX_LEN * 2];
+
+    for (int i = 0; argv[i] != NULL; i++) {
+        append_bytes(&key, &len, &cap, argv[i], strlen(argv[i]) + 1);
+        if (stat(argv[i], &st) < 0) {
+            continue;
+        }
+        uint64_t content[2];
+        if (S_ISREG(st.st_mode) && file_content_hash(argv[i], &st, content) == 0) {
+            append_bytes(&key, &len, &cap, "F", 1);
+            append_bytes(&key, &len, &cap, content, sizeof(content));
+        } else if (S_ISDIR(st.st_mode)) {
+            append_bytes(&key, &len, &cap, "D", 1);
+            append_stat_fields(&key, &len, &cap, &st);
+        }
+    }
+
+    if (getcwd(cwd, sizeof(cwd))) {
+        append_bytes(&key, &len, &cap, cwd, strlen(cwd) + 1);
+    }
+
+    const char* env_names = getenv("CACHE_ENV") ? getenv("CACHE_ENV") : CACHE_DEFAULT_ENV;
+    char* names = strdup(env_names);
+    for (char* name = strtok(names, ":"); name != NULL; name = strtok(NULL, ":")) {
+        const char* value = getenv(name);
+        append_bytes(&key, &len, &cap, name, strlen(name) + 1);
+        append_bytes(&key, &len, &cap, value ? value : "", value ? strlen(value) + 1 : 1);
+    }
+    free(names);
+
+    if (strchr(argv[0], '/') == NULL && getenv("PATH")) {
+        char* dirs = strdup(getenv("PATH"));
+        for (char* dir = strtok(dirs, ":"); dir != NULL; dir = strtok(NULL, ":")) {
+            char* exe = join_path(dir, argv[0]);
+            int found = stat(exe, &st) == 0 && S_ISREG(st.st_mode);
+            free(exe);
+            if (found) {
+                append_stat_fields(&key, &len, &cap, &st);
+                break;
+            }
+        }
+        free(dirs);
+    }
+
+    if (input != NULL) {
+        uint64_t content[2];
+        hash128(input, input_len, content);
+        append_bytes(&key, &len, &cap, "I", 1);
+        append_bytes(&key, &len, &cap, content, sizeof(content));
+    }
+
+    hash128(key, len, key_hash);
+    free(key);
+}
+
+int replay_cache_entry(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    CacheHeader header;
+    if (fstat(fd, &st) < 0 || read(fd, &header, sizeof(header)) != sizeof(header) || header.magic != CACHE_MAGIC ||
+        (uint64_t)st.st_size != sizeof(header) + header.out_len + header.err_len) {
+        close(fd);
+        return -1;
+    }
+    size_t len;
+    char* data = read_all(fd, &len);
+    close(fd);
+    fflush(stdout);
+    write_all(STDOUT_FILENO, data, header.out_len);
+    write_all(STDERR_FILENO, data + header.out_len, header.err_len);
+    free(data);
+    return header.status;
+}
+
+int run_and_capture(char** argv, const char* input, size_t input_len, char** out, size_t* out_len,
+                    char** err, size_t* err_len) {
+    int in_pipe[2] = {-1, -1}, out_pipe[2], err_pipe[2];
+    if ((input && pipe2(in_pipe, O_CLOEXEC) < 0) || pipe2(out_pipe, O_CLOEXEC) < 0 ||
+        pipe2(err_pipe, O_CLOEXEC) < 0) {
+        perror("cache: pipe failed");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Fork failed");
+        return -1;
+    } else if (pid == 0) {
+        if (input) dup2(in_pipe[0], STDIN_FILENO);
+        dup2(out_pipe[1], STDOUT_FILENO);
+        dup2(err_pipe[1], STDERR_FILENO);
+        execvp(argv[0], argv);
+        perror("Command execution failed");
+        exit(127);
+    }
+    if (input) {
+        close(in_pipe[0]);
+        fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+    }
+    close(out_pipe[1]);
+    close(err_pipe[1]);
+
+    size_t out_cap = 0, err_cap = 0, written = 0;
+    int fds[3] = {out_pipe[0], err_pipe[0], input ? in_pipe[1] : -1};
+    void (*old_pipe)(int) = signal(SIGPIPE, SIG_IGN);
+    while (fds[0] >= 0 || fds[1] >= 0) {
+        struct pollfd pfds[3];
+        for (int i = 0; i < 3; i++) {
+            pfds[i].fd = fds[i];
+            pfds[i].events = i < 2 ? POLLIN : POLLOUT;
+        }
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[2] >= 0 && pfds[2].revents) {
+            ssize_t n = write(fds[2], input + written, input_len - written);
+            if (n > 0) written += n;
+            if ((n < 0 && errno != EAGAIN) || written == input_len) {
+                close(fds[2]);
+                fds[2] = -1;
+            }
+        }
+        for (int i = 0; i < 2; i++) {
+            if (fds[i] < 0 || !pfds[i].revents) continue;
+            char buf[65536];
+            ssize_t n = read(fds[i], buf, sizeof(buf));
+            if (n > 0) {
+                append_bytes(i == 0 ? out : err, i == 0 ? out_len : err_len, i == 0 ? &out_cap : &err_cap, buf, n);
+            } else if (n == 0 || errno != EINTR) {
+                close(fds[i]);
+                fds[i] = -1;
+            }
+        }
     }
+    if (fds[2] >= 0) close(fds[2]);
+    signal(SIGPIPE, old_pipe);
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0) return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
 }
 
-void list_jobs() {
-    printf("Background jobs:\n");
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].active) {
-            printf("[%d] PID: %d, Command: %s\n", i + 1, jobs[i].pid, jobs[i].cmdline);
+void store_cache_entry(const char* path, int status, const char* out, size_t out_len, const char* err,
+                       size_t err_len) {
+    char tmp[MAX_LEN * 3];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) return;
+    CacheHeader header = {CACHE_MAGIC, status, out_len, err_len};
+    write_all(fd, (const char*)&header, sizeof(header));
+    write_all(fd, out, out_len);
+    write_all(fd, err, err_len);
+    close(fd);
+    if (rename(tmp, path) < 0) unlink(tmp);
+}
+
+void clear_cache() {
+    const char* dir = cache_dir();
+    if (dir == NULL) return;
+    const char* subdirs[] = {"", "/files"};
+    for (int i = 0; i < 2; i++) {
+        char path[MAX_LEN * 3];
+        snprintf(path, sizeof(path), "%s%s", dir, subdirs[i]);
+        DirListing* listing = list_directory(path);
+        for (int j = 0; listing && j < listing->count; j++) {
+            if (listing->types[j] == DT_DIR) continue;
+            char* entry = join_path(path, listing->names[j]);
+            unlink(entry);
+            free(entry);
         }
     }
 }
 
-void remove_job(pid_t pid) {
-    for (int i = 0; i < job_count; i++) {
-        if (jobs[i].pid == pid) {
-            jobs[i].active = 0;
-            break;
-        }
+void run_cached(char** arglist) {
+    int verbose = 0;
+    int i = 1;
+    if (arglist[i] != NULL && strcmp(arglist[i], "--clear") == 0) {
+        clear_cache();
+        return;
+    }
+    if (arglist[i] != NULL && strcmp(arglist[i], "-v") == 0) {
+        verbose = 1;
+        i++;
+    }
+    char** argv = arglist + i;
+    if (argv[0] == NULL) {
+        fprintf(stderr, "Usage: cache [-v] <command> [args...] | cache --clear\n");
+        return;
+    }
+
+    char* input = NULL;
+    size_t input_len = 0;
+    // Only hash stdin when it was redirected for this command, never the shell's own input
+    struct stat in_st;
+    if (!isatty(STDIN_FILENO) && fstat(STDIN_FILENO, &in_st) == 0 &&
+        (in_st.st_dev != shell_stdin.st_dev || in_st.st_ino != shell_stdin.st_ino)) {
+        input = read_all(STDIN_FILENO, &input_len);
+    }
+
+    // Without a cache directory the command still runs, just uncached
+    uint64_t key[2];
+    char entry[MAX_LEN * 3] = "";
+    const char* dir = cache_dir();
+    if (dir != NULL) {
+        cache_key(argv, input, input_len, key);
+        snprintf(entry, sizeof(entry), "%s/%016llx%016llx", dir, (unsigned long long)key[0],
+                 (unsigned long long)key[1]);
+    }
+
+    int status = entry[0] ? replay_cache_entry(entry) : -1;
+    if (status >= 0) {
+        if (verbose) fprintf(stderr, "cache: hit (exit %d)\n", status);
+        free(input);
+        return;
+    }
+
+    sigset_t mask, old_mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &old_mask);
+    char *out = NULL, *err = NULL;
+    size_t out_len = 0, err_len = 0;
+    status = run_and_capture(argv, input, input_len, &out, &out_len, &err, &err_len);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+
+    fflush(stdout);
+    write_all(STDOUT_FILENO, out, out_len);
+    write_all(STDERR_FILENO, err, err_len);
+    if (entry[0] && status >= 0 && status != 127) {
+        store_cache_entry(entry, status, out, out_len, err, err_len);
     }
+    if (verbose) fprintf(stderr, "cache: miss (exit %d)\n", status);
+    free(out);
+    free(err);
+    free(input);
 }
 
-void handle_sigchld(int sig) {
-    int status;
-    pid_t pid;
-    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-        remove_job(pid);
+char** watch_paths = NULL;
+int watch_cap = 0;
+int watch_count = 0;
+void set_watch_path(int wd, char* path) {
+    if (wd >= watch_cap) {
+        int cap = watch_cap ? watch_cap : 64;
+        while (cap <= wd) cap *= 2;
+        watch_paths = realloc(watch_paths, sizeof(char*) * cap);
+        memset(watch_paths + watch_cap, 0, sizeof(char*) * (cap - watch_cap));
+        watch_cap = cap;
+    }
+    if (watch_paths[wd]) {
+        free(watch_paths[wd]);
+    } else {
+        watch_count++;
     }
+    watch_paths[wd] = path;
 }
 
-int execute(char* arglist[], int is_background, const char* cmdline) {
-    if (arglist[0] == NULL) {
-        fprintf(stderr, "Error: empty command\n");
+void clear_watch_path(int wd) {
+    if (wd < watch_cap && watch_paths[wd]) {
+        free(watch_paths[wd]);
+        watch_paths[wd] = NULL;
+        watch_count--;
+    }
+}
+
+// Watch a path, and with recursion every directory below it. Listings are read
+// uncached and freed as the walk goes, so large trees stay cheap
+int add_watch_tree(int fd, const char* path, int recursive) {
+    int wd = inotify_add_watch(fd, path, WATCH_MASK);
+    if (wd < 0) {
+        if (errno == ENOSPC) {
+            fprintf(stderr, "on-change: inotify watch limit reached (see /proc/sys/fs/inotify/max_user_watches)\n");
+        } else {
+            fprintf(stderr, "on-change: %s: %s\n", path, strerror(errno));
+        }
         return -1;
     }
+    set_watch_path(wd, strdup(path));
+    if (!recursive) return 0;
+
+    DirListing* listing = read_directory(path);
+    if (!listing) return 0;
+    int rc = 0;
+    for (int i = 0; i < listing->count && rc == 0; i++) {
+        char* child = join_path(path, listing->names[i]);
+        if (is_directory(child, listing->types[i], 0)) {
+            rc = add_watch_tree(fd, child, recursive);
+        }
+        free(child);
+    }
+    free_listing(listing);
+    return rc;
+}
+
+Job* find_job(pid_t pid) {
+    for (int i = 0; i < job_count; i++) {
+        if (jobs[i].active && jobs[i].pid == pid) {
+            return &jobs[i];
+        }
+    }
+    return NULL;
+}
+
+// Stop a previous run that is still in the job table; SIGCHLD clears it once reaped
+void cancel_watch_run(pid_t pid) {
+    if (pid <= 0 || !find_job(pid)) return;
+    kill(-pid, SIGTERM);
+    for (int i = 0; i < 100 && find_job(pid); i++) {
+        usleep(10000);
+    }
+    if (find_job(pid)) {
+        kill(-pid, SIGKILL);
+        while (find_job(pid)) usleep(1000);
+    }
+}
 
+pid_t start_watch_run(char** argv, const char* cmdline) {
+    sigset_t old_mask;
+    block_sigchld(&old_mask);
     pid_t pid = fork();
     if (pid < 0) {
         perror("Fork failed");
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
         return -1;
     } else if (pid == 0) {
-        execvp(arglist[0], arglist);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        setpgid(0, 0);
+        signal(SIGINT, SIG_DFL);
+        execvp(argv[0], argv);
         perror("Command execution failed");
-        exit(1);
-    } else {
-        if (!is_background) {
-            waitpid(pid, NULL, 0);
+        exit(127);
+    }
+    setpgid(pid, pid);
+    Job* job = add_job(pid, cmdline);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    if (job == NULL) {
+        // An untracked run could never be cancelled, so it is not left running
+        kill(-pid, SIGKILL);
+        return -1;
+    }
+    return pid;
+}
+
+void run_on_change(char** arglist) {
+    int recursive = 0;
+    int debounce = WATCH_DEBOUNCE_MS;
+    int i = 1;
+    for (; arglist[i] != NULL && arglist[i][0] == '-' && strcmp(arglist[i], "--") != 0; i++) {
+        if (strcmp(arglist[i], "-r") == 0) {
+            recursive = 1;
+        } else if (strcmp(arglist[i], "-d") == 0 && arglist[i + 1] != NULL) {
+            debounce = atoi(arglist[++i]);
         } else {
-            printf("[Background] Process started with PID %d\n", pid);
-            add_job(pid, cmdline);
+            break;
         }
     }
-    return 0;
+    int first_path = i;
+    while (arglist[i] != NULL && strcmp(arglist[i], "--") != 0) i++;
+    if (i == first_path || arglist[i] == NULL || arglist[i + 1] == NULL) {
+        fprintf(stderr, "Usage: on-change [-r] [-d <ms>] <paths...> -- <cmd> [args...]\n");
+        return;
+    }
+    char** cmd = arglist + i + 1;
+    char cmdline[MAX_LEN] = "";
+    for (int j = 0; cmd[j] != NULL; j++) {
+        if (j > 0) strncat(cmdline, " ", sizeof(cmdline) - strlen(cmdline) - 1);
+        strncat(cmdline, cmd[j], sizeof(cmdline) - strlen(cmdline) - 1);
+    }
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+        perror("on-change: inotify_init1 failed");
+        return;
+    }
+    for (int j = first_path; j < i; j++) {
+        if (add_watch_tree(fd, arglist[j], recursive) < 0) break;
+    }
+
+    struct sigaction sa, old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_interrupt;
+    sigaction(SIGINT, &sa, &old_sa);
+    interrupted = 0;
+    fprintf(stderr, "on-change: watching %d path(s), Ctrl-C to stop\n", watch_count);
+
+    pid_t running = 0;
+    long long first_event = 0, deadline = 0;
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (!interrupted && watch_count > 0) {
+        int timeout = -1;
+        if (deadline) {
+            long long now = monotonic_ms();
+            timeout = deadline > now ? (int)(deadline - now) : 0;
+        }
+        struct pollfd pfd = {fd, POLLIN, 0};
+        int n = poll(&pfd, 1, timeout);
+        if (n < 0 && errno != EINTR) {
+            perror("on-change: poll failed");
+            break;
+        }
+
+        if (n > 0) {
+            ssize_t len;
+            while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                for (char* p = buf; p < buf + len;) {
+                    struct inotify_event* ev = (struct inotify_event*)p;
+                    p += sizeof(struct inotify_event) + ev->len;
+                    if (ev->mask & IN_IGNORED) {
+                        clear_watch_path(ev->wd);
+                        continue;
+                    }
+                    if (recursive && (ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) &&
+                        ev->wd < watch_cap && watch_paths[ev->wd]) {
+                        char* dir = join_path(watch_paths[ev->wd], ev->name);
+                        add_watch_tree(fd, dir, recursive);
+                        free(dir);
+                    }
+                    // Trailing-edge debounce, capped so a steady stream still triggers
+                    long long now = monotonic_ms();
+                    if (!first_event) first_event = now;
+                    deadline = now + debounce;
+                    if (deadline > first_event + (long long)debounce * WATCH_MAX_DELAY) {
+                        deadline = first_event + (long long)debounce * WATCH_MAX_DELAY;
+                    }
+                }
+            }
+        }
+
+        if (deadline && monotonic_ms() >= deadline) {
+            cancel_watch_run(running);
+            running = start_watch_run(cmd, cmdline);
+            first_event = deadline = 0;
+        }
+    }
+
+    sigaction(SIGINT, &old_sa, NULL);
+    cancel_watch_run(running);
+    close(fd);
+    for (int j = 0; j < watch_cap; j++) {
+        clear_watch_path(j);
+    }
 }
 
-int is_builtin(char* cmd) {
-    return strcmp(cmd, "cd") == 0 || strcmp(cmd, "exit") == 0 || strcmp(cmd, "jobs") == 0 ||
-           strcmp(cmd, "kill") == 0 || strcmp(cmd, "help") == 0;
+#ifndef NO_READLINE
+typedef struct {
+    char** names;  // sorted, unique executable names across $PATH
+    int count;
+    char* path;    // the $PATH this index was built from
+    struct timespec* mtimes;
+    int ndirs;
+} ExeIndex;
+
+ExeIndex* exe_index = NULL;
+ExeIndex* pending_index = NULL;
+int index_building = 0;
+long long index_checked = 0;
+pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void free_exe_index(ExeIndex* index) {
+    if (!index) return;
+    for (int i = 0; i < index->count; i++) free(index->names[i]);
+    free(index->names);
+    free(index->path);
+    free(index->mtimes);
+    free(index);
 }
 
-void handle_builtin(char** arglist) {
-    if (strcmp(arglist[0], "cd") == 0) {
-        if (arglist[1] == NULL || chdir(arglist[1]) != 0) {
-            perror("cd failed");
-        }
-    } else if (strcmp(arglist[0], "exit") == 0) {
-        printf("Exiting PUCITshell\n");
-        exit(0);
-    } else if (strcmp(arglist[0], "jobs") == 0) {
-        list_jobs();
-    } else if (strcmp(arglist[0], "kill") == 0) {
-        if (arglist[1] == NULL) {
-            fprintf(stderr, "Usage: kill <job_number>\n");
-            return;
+// Runs on a helper thread; the prompt keeps serving the previous index meanwhile
+void* build_exe_index(void* arg) {
+    ExeIndex* index = calloc(1, sizeof(ExeIndex));
+    PathList names = {0};
+    index->path = arg;
+    char* dirs = strdup(index->path);
+    index->mtimes = calloc(strlen(dirs) / 2 + 1, sizeof(struct timespec));
+
+    char* save;
+    for (char* dir = strtok_r(dirs, ":", &save); dir != NULL; dir = strtok_r(NULL, ":", &save)) {
+        struct stat st;
+        int slot = index->ndirs++;
+        if (stat(dir, &st) < 0) continue;
+        index->mtimes[slot] = st.st_mtim;
+        int dfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DirListing* listing = dfd >= 0 ? read_directory(dir) : NULL;
+        for (int i = 0; listing && i < listing->count; i++) {
+            if (listing->types[i] == DT_DIR) continue;
+            if (fstatat(dfd, listing->names[i], &st, 0) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+                path_list_push(&names, strdup(listing->names[i]));
+            }
         }
-        int job_num = atoi(arglist[1]);
-        if (job_num <= 0 || job_num > job_count || !jobs[job_num - 1].active) {
-            fprintf(stderr, "Invalid job number\n");
+        if (listing) free_listing(listing);
+        if (dfd >= 0) close(dfd);
+    }
+    free(dirs);
+
+    if (names.count > 0) {
+        char** tmp = malloc(sizeof(char*) * names.count);
+        radix_sort_strings(names.paths, tmp, names.count, 0);
+        free(tmp);
+    }
+    for (int i = 0; i < names.count; i++) {
+        if (index->count > 0 && strcmp(names.paths[index->count - 1], names.paths[i]) == 0) {
+            free(names.paths[i]);
         } else {
-            kill(jobs[job_num - 1].pid, SIGKILL);
-            jobs[job_num - 1].active = 0;
+            names.paths[index->count++] = names.paths[i];
         }
-    } else if (strcmp(arglist[0], "help") == 0) {
-        printf("PUCITshell Built-in Commands:\n");
-        printf("cd <directory> : Change the working directory\n");
-        printf("exit           : Exit the shell\n");
-        printf("jobs           : List background jobs\n");
-        printf("kill <job_num> : Kill a background job\n");
-        printf("help           : Show this help message\n");
     }
+    index->names = names.paths;
+
+    pthread_mutex_lock(&index_lock);
+    free_exe_index(pending_index);
+    pending_index = index;
+    index_building = 0;
+    pthread_mutex_unlock(&index_lock);
+    return NULL;
 }
 
-char** tokenize(char* cmdline, int* background) {
-    char** arglist = (char**)malloc(sizeof(char*) * (MAXARGS + 1));
-    int argnum = 0;
+void start_index_build() {
+    pthread_t thread;
+    const char* path = getenv("PATH");
+    index_building = 1;
+    // The thread starts with every signal blocked, so SIGIO, SIGCHLD and
+    // SIGINT keep going to the main thread, where block_sigio() and the
+    // EINTR-based Ctrl-C handling expect them
+    sigset_t all, old_mask;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old_mask);
+    int rc = pthread_create(&thread, NULL, build_exe_index, strdup(path ? path : ""));
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    if (rc != 0) {
+        index_building = 0;
+        return;
+    }
+    pthread_detach(thread);
+}
 
-    if (!arglist) {
-        fprintf(stderr, "Memory allocation error\n");
-        exit(1);
+int exe_index_stale(const ExeIndex* index) {
+    const char* path = getenv("PATH");
+    if (strcmp(index->path, path ? path : "") != 0) return 1;
+    char* dirs = strdup(index->path);
+    char* save;
+    int slot = 0, stale = 0;
+    for (char* dir = strtok_r(dirs, ":", &save); dir != NULL && !stale; dir = strtok_r(NULL, ":", &save)) {
+        struct stat st;
+        if (stat(dir, &st) < 0) {
+            st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        }
+        stale = st.st_mtim.tv_sec != index->mtimes[slot].tv_sec || st.st_mtim.tv_nsec != index->mtimes[slot].tv_nsec;
+        slot++;
+    }
+    free(dirs);
+    return stale;
+}
+
+// Adopt a freshly built index, and at most once a second check whether PATH moved
+void refresh_exe_index() {
+    pthread_mutex_lock(&index_lock);
+    if (pending_index) {
+        free_exe_index(exe_index);
+        exe_index = pending_index;
+        pending_index = NULL;
+    }
+    int building = index_building;
+    pthread_mutex_unlock(&index_lock);
+
+    long long now = monotonic_ms();
+    if (building || now - index_checked < COMPLETE_RECHECK_MS) return;
+    index_checked = now;
+    if (exe_index == NULL || exe_index_stale(exe_index)) {
+        start_index_build();
+    }
+}
+
+char* command_generator(const char* text, int state) {
+    static int pos, builtin;
+    size_t len = strlen(text);
+    if (state == 0) {
+        builtin = 0;
+        pos = 0;
+        if (exe_index) {
+            int lo = 0, hi = exe_index->count;
+            while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (strcmp(exe_index->names[mid], text) < 0) lo = mid + 1;
+                else hi = mid;
+            }
+            pos = lo;
+        }
+    }
+    while (builtin_names[builtin] != NULL) {
+        const char* name = builtin_names[builtin++];
+        if (strncmp(name, text, len) == 0) return strdup(name);
+    }
+    if (exe_index && pos < exe_index->count && strncmp(exe_index->names[pos], text, len) == 0) {
+        return strdup(exe_index->names[pos++]);
+    }
+    return NULL;
+}
+
+// Path completion from a getdents64 scan of the directory being typed in.
+// The scan keeps only names starting with the typed prefix. Each completion
+// attempt reads at most COMPLETE_READ_BYTES of directory entries and stops at
+// COMPLETE_MAX_MATCHES, so a keystroke in a huge or remote directory costs a
+// bounded read; what was found so far is offered, and the next attempt picks
+// up at the saved offset. The scan is reused while the directory's mtime
+// holds and the prefix only grows.
+char* path_generator(const char* text, int state) {
+    static DirListing* listing = NULL;
+    static struct timespec listing_mtime;
+    static char* dir = NULL;
+    static char* listed_prefix = NULL;
+    static const char* base;
+    static int pos, matches;
+
+    if (state == 0) {
+        const char* slash = strrchr(text, '/');
+        char* want = slash ? strndup(text, slash - text + 1) : strdup("");
+        base = slash ? slash + 1 : text;
+        struct stat st;
+        int have = stat(want[0] ? want : ".", &st) == 0;
+        if (listing && dir && strcmp(dir, want) == 0 && have &&
+            st.st_mtim.tv_sec == listing_mtime.tv_sec && st.st_mtim.tv_nsec == listing_mtime.tv_nsec &&
+            strncmp(base, listed_prefix, strlen(listed_prefix)) == 0 && (listed_prefix[0] || base[0] != '.')) {
+            free(want);
+            size_t base_len = strlen(base);
+            int found = 0;
+            for (int i = 0; i < listing->count; i++) {
+                found += strncmp(listing->names[i], base, base_len) == 0;
+            }
+            if (found < COMPLETE_MAX_MATCHES) {
+                continue_listing(listing, listed_prefix, COMPLETE_READ_BYTES,
+                                 listing->count + COMPLETE_MAX_MATCHES - found);
+            }
+        } else {
+            if (listing) free_listing(listing);
+            free(dir);
+            free(listed_prefix);
+            dir = want;
+            listed_prefix = strdup(base);
+            listing = have ? scan_directory(dir[0] ? dir : ".", base, COMPLETE_READ_BYTES, COMPLETE_MAX_MATCHES) : NULL;
+            if (have) listing_mtime = st.st_mtim;
+        }
+        pos = 0;
+        matches = 0;
+    }
+
+    size_t len = strlen(base);
+    while (listing && pos < listing->count && matches < COMPLETE_MAX_MATCHES) {
+        const char* name = listing->names[pos++];
+        if (strncmp(name, base, len) != 0 || (len == 0 && name[0] == '.')) continue;
+        matches++;
+        char* match = malloc(strlen(dir) + strlen(name) + 1);
+        sprintf(match, "%s%s", dir, name);
+        return match;
+    }
+    return NULL;
+}
+
+// text is the word from start to end in rl_line_buffer; only what comes
+// before it decides between command and path completion
+char** shell_completion(const char* text, int start, int end) {
+    (void)end;
+    int command_position = 1;
+    for (int i = start - 1; i >= 0; i--) {
+        if (rl_line_buffer[i] == '|') break;
+        if (rl_line_buffer[i] != ' ' && rl_line_buffer[i] != '\t') {
+            command_position = 0;
+            break;
+        }
+    }
+    rl_attempted_completion_over = 1;
+    if (command_position && strchr(text, '/') == NULL) {
+        refresh_exe_index();
+        return rl_completion_matches(text, command_generator);
     }
+    rl_filename_completion_desired = 1;
+    return rl_completion_matches(text, path_generator);
+}
+
+void init_completion() {
+    rl_attempted_completion_function = shell_completion;
+    refresh_exe_index();
+}
+
+#endif
 
-    char* token = strtok(cmdline, " \t\n");
-    while (token != NULL && argnum < MAXARGS) {
+char** tokenize(char* cmdline, int* background) {
+    PathList args = {0};
+    char* saveptr;
+
+    char* token = strtok_r(cmdline, " \t\n", &saveptr);
+    while (token != NULL) {
         if (strcmp(token, "&") == 0) {
             *background = 1;
+        } else if (strpbrk(token, "*?[") == NULL || expand_glob(token, &args) == 0) {
+            path_list_push(&args, strdup(token));
+        }
+        token = strtok_r(NULL, " \t\n", &saveptr);
+    }
+    path_list_push(&args, NULL);
+    return args.paths;
+}
+
+void run_builtin_redirected(char** argv, char* input_file, char* output_file) {
+    int saved_in = -1, saved_out = -1;
+    if (input_file) {
+        int in_fd = open(input_file, O_RDONLY | O_CLOEXEC);
+        if (in_fd < 0) {
+            perror("Input file open failed");
+            return;
+        }
+        saved_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 3);
+        dup2(in_fd, STDIN_FILENO);
+        close(in_fd);
+    }
+    if (output_file) {
+        int out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (out_fd < 0) {
+            perror("Output file open failed");
         } else {
-            arglist[argnum++] = strdup(token);
+            fflush(stdout);
+            saved_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 3);
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+    }
+
+    handle_builtin(argv);
+
+    if (saved_out >= 0) {
+        fflush(stdout);
+        dup2(saved_out, STDOUT_FILENO);
+        close(saved_out);
+    }
+    if (saved_in >= 0) {
+        dup2(saved_in, STDIN_FILENO);
+        close(saved_in);
+    }
+}
+
+typedef struct {
+    cpu_set_t cpus;
+    int has_cpus;
+    unsigned long nodes;
+    int has_nodes;
+} Placement;
+
+Placement pipeline_policy;
+int pipeline_pack = 0;
+
+int parse_cpu_list(const char* list, cpu_set_t* set) {
+    CPU_ZERO(set);
+    const char* p = list;
+    while (*p) {
+        char* end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p || first < 0) return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first) return -1;
+        }
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') end++;
+        else if (*end != '\0') return -1;
+        p = end;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+int read_sysfs_line(const char* path, char* buf, size_t size) {
+    FILE* fp = fopen(path, "r");
+    if (!fp) return -1;
+    char* ok = fgets(buf, size, fp);
+    fclose(fp);
+    if (!ok) return -1;
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+int parse_placement_option(const char* opt, Placement* placement) {
+    if (strncmp(opt, "cpus=", 5) == 0) {
+        if (parse_cpu_list(opt + 5, &placement->cpus) < 0) return -1;
+        placement->has_cpus = 1;
+        return 0;
+    }
+    if (strncmp(opt, "node=", 5) == 0) {
+        cpu_set_t nodes;
+        if (parse_cpu_list(opt + 5, &nodes) < 0) return -1;
+        placement->nodes = 0;
+        for (int n = 0; n < MAX_NUMA_NODES; n++) {
+            if (CPU_ISSET(n, &nodes)) placement->nodes |= 1UL << n;
+        }
+        placement->has_nodes = placement->nodes != 0;
+        return placement->has_nodes ? 0 : -1;
+    }
+    return -1;
+}
+
+void finish_placement(Placement* placement) {
+    if (!placement->has_nodes || placement->has_cpus) return;
+    char path[MAX_LEN], list[MAX_LEN * 2];
+    cpu_set_t node_cpus;
+    CPU_ZERO(&placement->cpus);
+    for (int n = 0; n < MAX_NUMA_NODES; n++) {
+        if (!(placement->nodes & (1UL << n))) continue;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+        if (read_sysfs_line(path, list, sizeof(list)) == 0 && parse_cpu_list(list, &node_cpus) == 0) {
+            CPU_OR(&placement->cpus, &placement->cpus, &node_cpus);
+            placement->has_cpus = 1;
+        }
+    }
+}
+
+void apply_placement(const Placement* placement) {
+    if (placement->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &placement->cpus) < 0) {
+        perror("sched_setaffinity failed");
+    }
+    if (placement->has_nodes &&
+        syscall(SYS_set_mempolicy, MPOL_BIND, &placement->nodes, MAX_NUMA_NODES + 1) < 0) {
+        perror("set_mempolicy failed");
+    }
+}
+
+int topology_value(int cpu, const char* name) {
+    char path[MAX_LEN], buf[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, name);
+    return read_sysfs_line(path, buf, sizeof(buf)) == 0 ? atoi(buf) : 0;
+}
+
+int packed_cpu_order(int* order) {
+    cpu_set_t allowed;
+    int keys[CPU_SETSIZE];
+    int n = 0;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) return 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) continue;
+        int key = topology_value(cpu, "physical_package_id") * 65536 + topology_value(cpu, "core_id");
+        int j = n++;
+        while (j > 0 && keys[j - 1] > key) {
+            keys[j] = keys[j - 1];
+            order[j] = order[j - 1];
+            j--;
+        }
+        keys[j] = key;
+        order[j] = cpu;
+    }
+    return n;
+}
+
+Placement stage_placement(int stage, const Placement* own) {
+    if (own->has_cpus || own->has_nodes) return *own;
+    Placement placement = pipeline_policy;
+    if (pipeline_pack) {
+        int order[CPU_SETSIZE];
+        int n = packed_cpu_order(order);
+        if (n > 0) {
+            CPU_ZERO(&placement.cpus);
+            CPU_SET(order[stage % n], &placement.cpus);
+            placement.has_cpus = 1;
+        }
+    }
+    return placement;
+}
+
+void print_placement_usage() {
+    fprintf(stderr, "Usage: on [cpus=<list>] [node=<list>] <command> [args...]\n");
+    fprintf(stderr, "       on --pipeline pack | off | [cpus=<list>] [node=<list>]\n");
+}
+
+void set_pipeline_policy(char** args) {
+    Placement policy;
+    memset(&policy, 0, sizeof(policy));
+    if (args[0] == NULL) {
+        print_placement_usage();
+        return;
+    }
+    if (strcmp(args[0], "off") == 0) {
+        pipeline_policy = policy;
+        pipeline_pack = 0;
+        return;
+    }
+    if (strcmp(args[0], "pack") == 0) {
+        pipeline_policy = policy;
+        pipeline_pack = 1;
+        return;
+    }
+    for (int i = 0; args[i] != NULL; i++) {
+        if (parse_placement_option(args[i], &policy) < 0) {
+            print_placement_usage();
+            return;
+        }
+    }
+    finish_placement(&policy);
+    pipeline_policy = policy;
+    pipeline_pack = 0;
+}
+
+char** parse_placement(char** arglist, Placement* placement) {
+    memset(placement, 0, sizeof(*placement));
+    if (arglist[0] == NULL || strcmp(arglist[0], "on") != 0) {
+        return arglist;
+    }
+    if (arglist[1] != NULL && strcmp(arglist[1], "--pipeline") == 0) {
+        set_pipeline_policy(arglist + 2);
+        return NULL;
+    }
+    int i = 1;
+    while (arglist[i] != NULL && strchr(arglist[i], '=') != NULL) {
+        if (parse_placement_option(arglist[i], placement) < 0) {
+            print_placement_usage();
+            return NULL;
         }
-        token = strtok(NULL, " \t\n");
+        i++;
+    }
+    if (arglist[i] == NULL) {
+        print_placement_usage();
+        return NULL;
     }
-    arglist[argnum] = NULL;
-    return arglist;
+    finish_placement(placement);
+    return arglist + i;
 }
 
 void handle_redirection_and_pipes(char* cmdline) {
@@ -153,39 +3195,68 @@ void handle_redirection_and_pipes(char* cmdline) {
         commands[++num_commands] = strtok(NULL, "|");
     }
 
-    if (num_commands > 1) {
-        pipe(pipe_fd);
-        if (fork() == 0) {
-            dup2(pipe_fd[1], STDOUT_FILENO);
-            close(pipe_fd[0]);
-            close(pipe_fd[1]);
+    if (num_commands == 1 && commands[1] != NULL) {
+        int background = 0;
+        char** first = tokenize(commands[0], &background);
+        char** second = tokenize(commands[1], &background);
+        Placement first_own, second_own;
+        char** first_argv = parse_placement(first, &first_own);
+        char** second_argv = parse_placement(second, &second_own);
+        Placement first_place = stage_placement(0, &first_own);
+        Placement second_place = stage_placement(1, &second_own);
 
-            int background = 0;
-            char** arglist = tokenize(commands[0], &background);
-            execute(arglist, background, commands[0]);
+        if ((first_argv && first_argv[0] && strcmp(first_argv[0], "limit") == 0) ||
+            (second_argv && second_argv[0] && strcmp(second_argv[0], "limit") == 0)) {
+            fprintf(stderr, "limit: not supported in pipelines\n");
+            first_argv = NULL;
+        }
 
-            for (int i = 0; arglist[i] != NULL; i++) free(arglist[i]);
-            free(arglist);
-            exit(0);
+        if (first_argv == NULL || second_argv == NULL) {
+            // nothing to run
+        } else if (pipe(pipe_fd) < 0) {
+            perror("pipe failed");
         } else {
-            if (fork() == 0) {
+            // Both stages are waited for by pid with SIGCHLD blocked, so
+            // handle_sigchld can neither reap them first nor leave wait()
+            // to collect a background job or coproc instead
+            sigset_t old_mask;
+            block_sigchld(&old_mask);
+            pid_t first_pid = fork();
+            if (first_pid == 0) {
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                dup2(pipe_fd[1], STDOUT_FILENO);
+                close(pipe_fd[0]);
+                close(pipe_fd[1]);
+
+                apply_placement(&first_place);
+                execute(first_argv, background, commands[0]);
+                exit(0);
+            }
+            pid_t second_pid = first_pid < 0 ? -1 : fork();
+            if (second_pid == 0) {
+                sigprocmask(SIG_SETMASK, &old_mask, NULL);
                 dup2(pipe_fd[0], STDIN_FILENO);
                 close(pipe_fd[1]);
                 close(pipe_fd[0]);
 
-                int background = 0;
-                char** arglist = tokenize(commands[1], &background);
-                execute(arglist, background, commands[1]);
-
-                for (int i = 0; arglist[i] != NULL; i++) free(arglist[i]);
-                free(arglist);
+                apply_placement(&second_place);
+                execute(second_argv, background, commands[1]);
                 exit(0);
             }
+            if (first_pid < 0 || second_pid < 0) {
+                perror("Fork failed");
+            }
             close(pipe_fd[0]);
             close(pipe_fd[1]);
-            wait(NULL);
-            wait(NULL);
+            if (first_pid > 0) waitpid(first_pid, NULL, 0);
+            if (second_pid > 0) waitpid(second_pid, NULL, 0);
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
         }
+
+        for (int i = 0; first[i] != NULL; i++) free(first[i]);
+        free(first);
+        for (int i = 0; second[i] != NULL; i++) free(second[i]);
+        free(second);
     } else {
         char* input_file = NULL;
         char* output_file = NULL;
@@ -203,11 +3274,66 @@ void handle_redirection_and_pipes(char* cmdline) {
         int background = 0;
         char** arglist = tokenize(cmdline, &background);
 
-        if (is_builtin(arglist[0])) {
-            handle_builtin(arglist);
+        char cgroup[MAX_LEN] = "";
+        Placement placement;
+        char** argv = parse_placement(arglist, &placement);
+        if (argv == NULL) {
+            ;
+        } else if (is_builtin(argv[0])) {
+            run_builtin_redirected(argv, input_file, output_file);
+        } else if (strcmp(argv[0], "limit") == 0 &&
+                   (argv = setup_limit(argv, cgroup, sizeof(cgroup))) == NULL) {
+            ;
         } else {
-            pid_t pid = fork();
+            pid_t pid = -2;
+            int via_zygote = 0;
+            int capture_fd[2] = {-1, -1};
+            size_t ring_size = 0;
+            if (background && capture_jobs && !output_file && !job_slot_available()) {
+                fprintf(stderr, "jobs: job table full, output goes to the terminal\n");
+            } else if (background && capture_jobs && !output_file) {
+                ring_size = reserve_job_ring();
+                if (ring_size == 0) {
+                    fprintf(stderr, "jobs: capture memory exhausted, output goes to the terminal\n");
+                } else if (pipe2(capture_fd, O_CLOEXEC) < 0) {
+                    perror("jobs: capture pipe failed");
+                }
+            }
+            if (zygote_fd >= 0 && cgroup[0] == '\0' && !placement.has_cpus && !placement.has_nodes) {
+                int in_fd = input_file ? open(input_file, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+                int out_fd = output_file ? open(output_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)
+                                         : capture_fd[1] >= 0 ? capture_fd[1] : STDOUT_FILENO;
+                int err_fd = capture_fd[1] >= 0 ? capture_fd[1] : STDERR_FILENO;
+                if (in_fd < 0) {
+                    perror("Input file open failed");
+                    pid = -1;
+                } else if (out_fd < 0) {
+                    perror("Output file open failed");
+                    pid = -1;
+                } else {
+                    pid = zygote_launch(argv, in_fd, out_fd, err_fd);
+                    via_zygote = pid > 0;
+                }
+                if (in_fd > STDIN_FILENO) close(in_fd);
+                if (output_file && out_fd > STDOUT_FILENO) close(out_fd);
+            }
+            sigset_t old_mask;
+            if (background) block_sigchld(&old_mask);
+            if (pid == -2) {
+                pid = fork();
+            }
             if (pid == 0) {
+                if (background) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+                apply_placement(&placement);
+                if (cgroup[0] != '\0') {
+                    // A foreground job stays in the shell's process group so
+                    // Ctrl-C reaches it
+                    if (background) setpgid(0, 0);
+                    if (write_cgroup_file(cgroup, "cgroup.procs", "0") < 0) {
+                        perror("limit: cannot join cgroup");
+                        exit(1);
+                    }
+                }
                 if (input_file) {
                     int in_fd = open(input_file, O_RDONLY);
                     if (in_fd < 0) {
@@ -226,14 +3352,34 @@ void handle_redirection_and_pipes(char* cmdline) {
                     dup2(out_fd, STDOUT_FILENO);
                     close(out_fd);
                 }
-                execvp(arglist[0], arglist);
+                if (capture_fd[1] >= 0) {
+                    dup2(capture_fd[1], STDOUT_FILENO);
+                    dup2(capture_fd[1], STDERR_FILENO);
+                }
+                execvp(argv[0], argv);
                 perror("Command execution failed");
                 exit(1);
+            } else if (pid < 0) {
+                ;
             } else if (!background) {
-                waitpid(pid, NULL, 0);
+                if (via_zygote) {
+                    ZygoteEvent ev;
+                    wait_zygote_event(ZYGOTE_EXITED, pid, &ev);
+                } else {
+                    waitpid(pid, NULL, 0);
+                }
+                if (cgroup[0] != '\0') rmdir(cgroup);
             } else {
-                add_job(pid, cmdline);
+                Job* job = add_job(pid, cmdline);
+                if (job != NULL) strcpy(job->cgroup, cgroup);
+                if (job != NULL && capture_fd[0] >= 0) {
+                    attach_job_output(job, capture_fd[0], ring_size);
+                    capture_fd[0] = -1;
+                }
             }
+            if (background) sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            if (capture_fd[0] >= 0) close(capture_fd[0]);
+            if (capture_fd[1] >= 0) close(capture_fd[1]);
         }
 
         for (int i = 0; arglist[i] != NULL; i++) free(arglist[i]);
@@ -241,15 +3387,25 @@ void handle_redirection_and_pipes(char* cmdline) {
     }
 }
 
-int main() {
+int main(int argc, char* argv[]) {
     char* cmdline;
+    if (argc > 1 && strcmp(argv[1], "--zygote") == 0) {
+        start_zygote();
+    }
     signal(SIGCHLD, handle_sigchld);
-    using_history();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigio;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGIO, &sa, NULL);
+    fstat(STDIN_FILENO, &shell_stdin);
 
-    while ((cmdline = readline(PROMPT)) != NULL) {
+    while ((cmdline = read_command_line(PROMPT)) != NULL) {
         if (strlen(cmdline) > 0) {
-            add_history(cmdline);
+            drain_zygote_events();
             handle_redirection_and_pipes(cmdline);
+            clear_dir_cache();
+            release_job_cgroups();
         }
         free(cmdline);
     }
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,47 +6,133 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <pwd.h>
+#ifndef NO_READLINE
 #include <readline/readline.h>
 #include <readline/history.h>
+#endif
+#include "line_reader.h"
 
 #define MAX_LEN 512
 #define MAXARGS 10
 #define MAX_VARS 100
 #define HISTORY_SIZE 10
 #define PROMPT "ELEVENshell:- "
+#define CAPTURE_CHUNK 65536
+#define MAX_CACHED_PATHS 128
+#define SERVER_MSG_SIZE 65536
+#define MAX_ALIASES 64
+#define MAX_CLIENTS 64
+#define RC_SNAPSHOT_MAGIC 0x32534e52
 
+#ifndef NO_VARS
 struct var {
     char *name;
     char *value;
     int global;
 };
+#endif
 
+struct path_entry {
+    char *name;
+    char *path;
+};
+
+struct alias {
+    char *name;
+    char *value;
+    int active;
+};
+
+// Header of the rc snapshot, followed by state_len bytes of rc state
+// (records of kind, name and value, each NUL-terminated: "e" for an export
+// into the environment, "v"/"g" for a local/global variable, "a" for an alias)
+// and path_len bytes of PATH cache (the PATH it belongs to, the mtimes of its
+// directories, then name/path pairs). The rc file's identity decides whether
+// the snapshot is current; the directory mtimes decide whether the PATH
+// cache still is.
+struct rc_snapshot {
+    unsigned int magic;
+    dev_t rc_dev;
+    ino_t rc_ino;
+    off_t rc_size;
+    struct timespec rc_mtime;
+    struct timespec rc_ctime;
+    size_t state_len;
+    size_t path_len;
+};
+
+// Reply sent back to a --server client for every request
+struct server_reply {
+    int status;
+    struct rusage usage;
+};
+
+#ifndef NO_VARS
 struct var vars[MAX_VARS];
 int var_count = 0;
+#endif
+#ifndef NO_JOBS
 int background_jobs[HISTORY_SIZE];
 int job_count = 0;
+#endif
+struct path_entry path_cache[MAX_CACHED_PATHS];
+int path_cache_count = 0;
+char *path_cache_env = NULL;
+char *path_cache_stamp = NULL;
+int path_cache_dirty = 0;
+struct alias aliases[MAX_ALIASES];
+int alias_count = 0;
+struct stat rc_stat;
+char *rc_state = NULL;
+size_t rc_state_len = 0;
+size_t rc_state_cap = 0;
+int rc_loading = 0;
+int rc_snapshot_ok = 0;
+pid_t shell_pid;
+int server_mode = 0;
+int last_status = 0;
+struct rusage last_usage;
 
-// Set variable
-int set_variable(char *name, char *value, int global) {
+int parse_and_execute(char *cmdline);
+void record_rc_state(const char *kind, const char *name, const char *value);
+
+#ifndef NO_VARS
+// Set variable, taking ownership of a malloc'd value
+int set_variable_owned(char *name, char *value, int global) {
     for (int i = 0; i < var_count; i++) {
         if (strcmp(vars[i].name, name) == 0) {
             free(vars[i].value);
-            vars[i].value = strdup(value);
+            vars[i].value = value;
             vars[i].global = global;
             return 0;
         }
     }
     if (var_count < MAX_VARS) {
         vars[var_count].name = strdup(name);
-        vars[var_count].value = strdup(value);
+        vars[var_count].value = value;
         vars[var_count].global = global;
         var_count++;
         return 0;
     }
     fprintf(stderr, "Error: variable limit reached\n");
+    free(value);
     return -1;
 }
 
+// Set variable
+int set_variable(char *name, char *value, int global) {
+    return set_variable_owned(name, strdup(value), global);
+}
+
 // Retrieve variable
 char* get_variable(char *name) {
     for (int i = 0; i < var_count; i++) {
@@ -75,6 +162,56 @@ void printvars() {
         printf("%s=%s\n", vars[i].name, vars[i].value);
     }
 }
+#endif
+
+// Define or replace an alias
+void set_alias(char *name, char *value) {
+    for (int i = 0; i < alias_count; i++) {
+        if (strcmp(aliases[i].name, name) == 0) {
+            free(aliases[i].value);
+            aliases[i].value = strdup(value);
+            return;
+        }
+    }
+    if (alias_count == MAX_ALIASES) {
+        fprintf(stderr, "Error: alias limit reached\n");
+        return;
+    }
+    aliases[alias_count].name = strdup(name);
+    aliases[alias_count].value = strdup(value);
+    aliases[alias_count].active = 0;
+    alias_count++;
+}
+
+// Remove an alias
+void unset_alias(char *name) {
+    for (int i = 0; i < alias_count; i++) {
+        if (strcmp(aliases[i].name, name) == 0) {
+            free(aliases[i].name);
+            free(aliases[i].value);
+            aliases[i] = aliases[--alias_count];
+            return;
+        }
+    }
+    fprintf(stderr, "Alias %s not found\n", name);
+}
+
+// Find the alias named by the first len bytes of word
+struct alias *find_alias(char *word, size_t len) {
+    for (int i = 0; i < alias_count; i++) {
+        if (strlen(aliases[i].name) == len && strncmp(aliases[i].name, word, len) == 0) {
+            return &aliases[i];
+        }
+    }
+    return NULL;
+}
+
+// Print all aliases
+void list_aliases() {
+    for (int i = 0; i < alias_count; i++) {
+        printf("alias %s %s\n", aliases[i].name, aliases[i].value);
+    }
+}
 
 // Print environment variables
 void printenv_vars() {
@@ -84,6 +221,7 @@ void printenv_vars() {
     }
 }
 
+#ifndef NO_JOBS
 // List background jobs
 void list_jobs() {
     printf("Background jobs:\n");
@@ -92,6 +230,21 @@ void list_jobs() {
     }
 }
 
+// Reap finished background jobs and drop them from the job list. Only
+// called between commands, when no foreground child can be waiting.
+void reap_background_jobs() {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (int i = 0; i < job_count; i++) {
+            if (background_jobs[i] == pid) {
+                background_jobs[i] = background_jobs[--job_count];
+                break;
+            }
+        }
+    }
+}
+
 // Kill a background job by PID
 void kill_job(int job_num) {
     if (job_num > 0 && job_num <= job_count) {
@@ -105,9 +258,268 @@ void kill_job(int job_num) {
         fprintf(stderr, "Invalid job number\n");
     }
 }
+#endif
+
+// Run cmd in a child and return its stdout with trailing newlines stripped.
+// The buffer grows geometrically and read() fills it in place, so capture is
+// linear in the output size (glibc services large reallocs with mremap).
+char* capture_output(char *cmd, size_t *out_len) {
+    int fd[2];
+    if (pipe(fd) < 0) {
+        perror("pipe failed");
+        return NULL;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork failed");
+        close(fd[0]);
+        close(fd[1]);
+        return NULL;
+    } else if (pid == 0) {
+        close(fd[0]);
+        dup2(fd[1], STDOUT_FILENO);
+        close(fd[1]);
+        exit(parse_and_execute(cmd) < 0 ? 1 : 0);
+    }
+    close(fd[1]);
+
+    size_t cap = CAPTURE_CHUNK;
+    size_t len = 0;
+    char *buf = malloc(cap);
+    while (buf) {
+        if (cap - len < CAPTURE_CHUNK / 4) {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = read(fd[0], buf + len, cap - len - 1);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    close(fd[0]);
+    waitpid(pid, NULL, 0);
+
+    if (!buf) {
+        fprintf(stderr, "Error: out of memory capturing output\n");
+        return NULL;
+    }
+    while (len > 0 && buf[len - 1] == '\n') {
+        len--;
+    }
+    buf[len] = '\0';
+    *out_len = len;
+    return buf;
+}
+
+// Find the ')' closing a "$(" that starts at open
+char* find_substitution_end(char *open) {
+    int depth = 0;
+    for (char *p = open; *p; p++) {
+        if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+// Replace every $(...) in cmdline with the output of the enclosed command.
+// Returns cmdline itself when there is nothing to expand, else a new string,
+// or NULL when a substitution failed and the command must not run.
+char* expand_command_substitution(char *cmdline) {
+    char *start = strstr(cmdline, "$(");
+    if (!start) {
+        return cmdline;
+    }
+
+    size_t cap = strlen(cmdline) + 1;
+    size_t len = 0;
+    char *result = malloc(cap);
+    if (!result) {
+        fprintf(stderr, "Error: out of memory expanding $(\n");
+        return NULL;
+    }
+    char *p = cmdline;
+    while (start) {
+        char *end = find_substitution_end(start + 1);
+        if (!end) {
+            fprintf(stderr, "Error: unterminated $(\n");
+            free(result);
+            return NULL;
+        }
+        *end = '\0';
+        size_t out_len = 0;
+        char *output = capture_output(start + 2, &out_len);
+        if (!output) {
+            free(result);
+            return NULL;
+        }
+        size_t prefix = start - p;
+        size_t need = len + prefix + out_len + strlen(end + 1) + 1;
+        if (need > cap) {
+            size_t grown_cap = cap * 2 > need ? cap * 2 : need;
+            char *grown = realloc(result, grown_cap);
+            if (!grown) {
+                fprintf(stderr, "Error: out of memory expanding $(\n");
+                free(output);
+                free(result);
+                return NULL;
+            }
+            result = grown;
+            cap = grown_cap;
+        }
+        memcpy(result + len, p, prefix);
+        len += prefix;
+        memcpy(result + len, output, out_len);
+        len += out_len;
+        free(output);
+        p = end + 1;
+        start = strstr(p, "$(");
+    }
+    strcpy(result + len, p);
+    return result;
+}
+
+#ifndef NO_VARS
+// Handle "set <var> $(cmd)" by moving the captured buffer straight into the
+// variable store. Returns 0 if the assignment was handled here.
+int assign_command_substitution(char *args) {
+    char *name = args + strspn(args, " \t");
+    char *name_end = name + strcspn(name, " \t");
+    char *value = name_end + strspn(name_end, " \t");
+    if (name == name_end || strncmp(value, "$(", 2) != 0) {
+        return 1;
+    }
+    char *end = find_substitution_end(value + 1);
+    if (!end || end[1 + strspn(end + 1, " \t")] != '\0') {
+        return 1;
+    }
+
+    *name_end = '\0';
+    *end = '\0';
+    size_t out_len = 0;
+    char *output = capture_output(value + 2, &out_len);
+    if (!output) {
+        last_status = 1;
+        return 0;
+    }
+    set_variable_owned(name, output, 0);
+    return 0;
+}
+#endif
+
+// Describe the mtime of every PATH directory, so a cache built against them
+// can tell when a command was added to or removed from one
+char* path_dir_stamp(const char *path_env) {
+    char *dirs = strdup(path_env);
+    char *stamp = NULL;
+    size_t len = 0, cap = 0;
+    for (char *dir = strtok(dirs, ":"); dir; dir = strtok(NULL, ":")) {
+        struct stat st;
+        char entry[64];
+        if (stat(dir, &st) < 0) {
+            st.st_mtim.tv_sec = st.st_mtim.tv_nsec = 0;
+        }
+        int n = snprintf(entry, sizeof(entry), "%lld.%09ld:", (long long)st.st_mtim.tv_sec, st.st_mtim.tv_nsec);
+        if (len + n + 1 > cap) {
+            cap = cap ? cap * 2 : 256;
+            char *grown = realloc(stamp, cap);
+            if (!grown) {
+                free(stamp);
+                free(dirs);
+                return NULL;
+            }
+            stamp = grown;
+        }
+        memcpy(stamp + len, entry, n + 1);
+        len += n;
+    }
+    free(dirs);
+    return stamp ? stamp : strdup("");
+}
+
+// Drop all cached command paths
+void flush_path_cache() {
+    for (int i = 0; i < path_cache_count; i++) {
+        free(path_cache[i].name);
+        free(path_cache[i].path);
+    }
+    path_cache_count = 0;
+}
+
+// Resolve a command name against $PATH, remembering the result until PATH changes
+char* resolve_command(char *name) {
+    if (strchr(name, '/')) {
+        return name;
+    }
+    char *path_env = getenv("PATH");
+    if (!path_env) {
+        return name;
+    }
+    if (!path_cache_env || strcmp(path_cache_env, path_env) != 0) {
+        flush_path_cache();
+        free(path_cache_env);
+        free(path_cache_stamp);
+        path_cache_env = strdup(path_env);
+        path_cache_stamp = path_dir_stamp(path_env);
+    }
+    for (int i = 0; i < path_cache_count; i++) {
+        if (strcmp(path_cache[i].name, name) == 0) {
+            return path_cache[i].path;
+        }
+    }
+
+    // A hit in a relative PATH entry such as "." depends on the working
+    // directory, so it is returned without being cached
+    static char candidate[MAX_LEN * 2];
+    char *dirs = strdup(path_env);
+    char *found = NULL;
+    int relative = 0;
+    for (char *dir = strtok(dirs, ":"); dir; dir = strtok(NULL, ":")) {
+        snprintf(candidate, sizeof(candidate), "%s/%s", dir, name);
+        if (access(candidate, X_OK) == 0) {
+            relative = dir[0] != '/';
+            found = relative ? candidate : strdup(candidate);
+            break;
+        }
+    }
+    free(dirs);
+    if (!found) {
+        return name;
+    }
+    if (relative) {
+        return found;
+    }
+    if (path_cache_count == MAX_CACHED_PATHS) {
+        flush_path_cache();
+    }
+    path_cache[path_cache_count].name = strdup(name);
+    path_cache[path_cache_count].path = found;
+    path_cache_dirty = 1;
+    return path_cache[path_cache_count++].path;
+}
 
 // Execute command with redirection and background
 int execute_command(char **arglist, int background) {
+#ifndef NO_JOBS
+    if (background && job_count == HISTORY_SIZE) {
+        reap_background_jobs();
+        if (job_count == HISTORY_SIZE) {
+            fprintf(stderr, "Error: too many background jobs\n");
+            return -1;
+        }
+    }
+#endif
+    char *path = resolve_command(arglist[0]);
     pid_t pid = fork();
     if (pid == 0) {
         if (background) {
@@ -128,33 +540,54 @@ int execute_command(char **arglist, int background) {
                 arglist[i] = NULL;
             }
         }
+        if (path != arglist[0]) {
+            execv(path, arglist);
+        }
         execvp(arglist[0], arglist);
         perror("Command execution failed");
         exit(1);
     } else {
         if (background) {
+#ifndef NO_JOBS
             background_jobs[job_count++] = pid;
+#endif
             printf("Background job started with PID %d\n", pid);
         } else {
-            waitpid(pid, NULL, 0);
+            int status;
+            if (wait4(pid, &status, 0, &last_usage) == pid) {
+                last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
         }
     }
     return 0;
 }
 
-// Parse and execute command line
-int parse_and_execute(char *cmdline) {
+// Run a builtin or external command from a fully expanded line. Nothing in
+// the line is expanded again, so substituted output is always literal text.
+int execute_line(char *cmdline) {
     if (strncmp(cmdline, "cd ", 3) == 0) {
         chdir(cmdline + 3);
     } else if (strcmp(cmdline, "exit") == 0) {
-        exit(0);
+        if (!server_mode) {
+            exit(0);
+        }
+#ifndef NO_JOBS
     } else if (strcmp(cmdline, "jobs") == 0) {
         list_jobs();
     } else if (strncmp(cmdline, "kill ", 5) == 0) {
         int job_num = atoi(cmdline + 5);
         kill_job(job_num);
+#endif
     } else if (strcmp(cmdline, "help") == 0) {
-        printf("Available commands:\ncd, exit, jobs, kill, set, export, unset, printvars, printenv\n");
+        printf("Available commands:\ncd, exit, "
+#ifndef NO_JOBS
+               "jobs, kill, "
+#endif
+#ifndef NO_VARS
+               "set, export, unset, printvars, "
+#endif
+               "printenv, alias, unalias\n");
+#ifndef NO_VARS
     } else if (strncmp(cmdline, "set ", 4) == 0) {
         char *name = strtok(cmdline + 4, " ");
         char *value = strtok(NULL, " ");
@@ -165,10 +598,32 @@ int parse_and_execute(char *cmdline) {
             if (strcmp(vars[i].name, name) == 0) {
                 setenv(vars[i].name, vars[i].value, 1);
                 vars[i].global = 1;
+                if (rc_loading) {
+                    record_rc_state("e", vars[i].name, vars[i].value);
+                }
                 return 0;
             }
         }
         fprintf(stderr, "Variable %s not found\n", name);
+#endif
+    } else if (strcmp(cmdline, "alias") == 0) {
+        list_aliases();
+    } else if (strncmp(cmdline, "alias ", 6) == 0) {
+        char *name = strtok(cmdline + 6, " ");
+        char *value = strtok(NULL, "");
+        if (value) {
+            value += strspn(value, " ");
+        }
+        if (!name || !value || !*value) {
+            fprintf(stderr, "Usage: alias name command...\n");
+        } else {
+            set_alias(name, value);
+        }
+    } else if (strncmp(cmdline, "unalias ", 8) == 0) {
+        char *name = strtok(cmdline + 8, " ");
+        if (name) {
+            unset_alias(name);
+        }
     } else {
         char *arglist[MAXARGS + 1];
         char *token = strtok(cmdline, " \t\n");
@@ -177,6 +632,10 @@ int parse_and_execute(char *cmdline) {
         
         while (token && i < MAXARGS) {
             if (strcmp(token, "&") == 0) {
+#ifdef NO_JOBS
+                fprintf(stderr, "Error: background jobs not built in\n");
+                return -1;
+#endif
                 background = 1;
                 break;
             }
@@ -190,13 +649,625 @@ int parse_and_execute(char *cmdline) {
     return 0;
 }
 
-int main() {
-    using_history();
+// Parse and execute command line: aliases first, then a single pass of
+// command substitution over the original text
+int parse_and_execute(char *cmdline) {
+#ifndef NO_VARS
+    if (strncmp(cmdline, "set ", 4) == 0 && assign_command_substitution(cmdline + 4) == 0) {
+        return 0;
+    }
+#endif
+
+    // An alias is skipped while its own expansion runs, so "alias ls ls -F"
+    // and alias loops terminate
+    size_t word_len = strcspn(cmdline, " \t");
+    struct alias *alias = find_alias(cmdline, word_len);
+    if (alias && !alias->active) {
+        char *aliased = malloc(strlen(alias->value) + strlen(cmdline + word_len) + 1);
+        sprintf(aliased, "%s%s", alias->value, cmdline + word_len);
+        alias->active = 1;
+        parse_and_execute(aliased);
+        alias->active = 0;
+        free(aliased);
+        return 0;
+    }
+
+    char *expanded = expand_command_substitution(cmdline);
+    if (!expanded) {
+        last_status = 1;
+        return -1;
+    }
+    execute_line(expanded);
+    if (expanded != cmdline) {
+        free(expanded);
+    }
+    return 0;
+}
+
+// Path of the rc file: $ELEVENSHELL_RC or ~/.elevenshellrc
+int rc_file_path(char *buf, size_t size) {
+    char *rc = getenv("ELEVENSHELL_RC");
+    if (rc) {
+        snprintf(buf, size, "%s", rc);
+    } else if (getenv("HOME")) {
+        snprintf(buf, size, "%s/.elevenshellrc", getenv("HOME"));
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Path of the rc snapshot, in the same cache directory v5 uses. Without a
+// home directory there is no snapshot: a shared fallback such as /tmp would
+// let another user plant one.
+int rc_snapshot_path(char *buf, size_t size) {
+    char *base;
+    struct passwd *pw;
+    if ((base = getenv("SHELL_CACHE_DIR")) != NULL) {
+        snprintf(buf, size, "%s/rc.snap", base);
+    } else if ((base = getenv("XDG_CACHE_HOME")) != NULL) {
+        snprintf(buf, size, "%s/elevenshell/rc.snap", base);
+    } else if ((base = getenv("HOME")) != NULL || ((pw = getpwuid(getuid())) != NULL && (base = pw->pw_dir) != NULL)) {
+        snprintf(buf, size, "%s/.cache/elevenshell/rc.snap", base);
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+// Only statements whose effect is pure shell state can be replayed from a
+// snapshot; an rc that runs commands is evaluated on every start
+int is_rc_statement(char *line) {
+    if (strstr(line, "$(")) {
+        return 0;
+    }
+#ifndef NO_VARS
+    if (strncmp(line, "set ", 4) == 0 || strncmp(line, "export ", 7) == 0) {
+        return 1;
+    }
+#endif
+    return strncmp(line, "alias ", 6) == 0 || strncmp(line, "unalias ", 8) == 0;
+}
+
+// Append a NUL-terminated string to a growing buffer
+void append_record(char **buf, size_t *len, size_t *cap, const char *str) {
+    size_t n = strlen(str) + 1;
+    while (*len + n > *cap) {
+        *cap = *cap ? *cap * 2 : 1024;
+        *buf = realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, str, n);
+    *len += n;
+}
+
+// Add one record to the rc state
+void record_rc_state(const char *kind, const char *name, const char *value) {
+    append_record(&rc_state, &rc_state_len, &rc_state_cap, kind);
+    append_record(&rc_state, &rc_state_len, &rc_state_cap, name);
+    append_record(&rc_state, &rc_state_len, &rc_state_cap, value);
+}
+
+// Serialize the variables and aliases the rc file left behind, after the
+// exports recorded while it ran
+void capture_rc_state() {
+#ifndef NO_VARS
+    for (int i = 0; i < var_count; i++) {
+        record_rc_state(vars[i].global ? "g" : "v", vars[i].name, vars[i].value);
+    }
+#endif
+    for (int i = 0; i < alias_count; i++) {
+        record_rc_state("a", aliases[i].name, aliases[i].value);
+    }
+}
+
+// Write the snapshot: rc state plus whatever the PATH cache holds now, unless
+// a PATH directory changed since the cache was started. Written to a
+// temporary file and renamed so readers never see half of it.
+void save_rc_snapshot() {
+    char path[MAX_LEN * 2], tmp[MAX_LEN * 2 + 32];
+    if (rc_snapshot_path(path, sizeof(path)) < 0) {
+        return;
+    }
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+
+    char *paths = NULL;
+    size_t paths_len = 0, cap = 0;
+    char *stamp = path_cache_env ? path_dir_stamp(path_cache_env) : NULL;
+    if (stamp && path_cache_stamp && strcmp(stamp, path_cache_stamp) == 0) {
+        append_record(&paths, &paths_len, &cap, path_cache_env);
+        append_record(&paths, &paths_len, &cap, stamp);
+        for (int i = 0; i < path_cache_count; i++) {
+            append_record(&paths, &paths_len, &cap, path_cache[i].name);
+            append_record(&paths, &paths_len, &cap, path_cache[i].path);
+        }
+    }
+
+    struct rc_snapshot hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = RC_SNAPSHOT_MAGIC;
+    hdr.rc_dev = rc_stat.st_dev;
+    hdr.rc_ino = rc_stat.st_ino;
+    hdr.rc_size = rc_stat.st_size;
+    hdr.rc_mtime = rc_stat.st_mtim;
+    hdr.rc_ctime = rc_stat.st_ctim;
+    hdr.state_len = rc_state_len;
+    hdr.path_len = paths_len;
+    struct iovec iov[3] = {{&hdr, sizeof(hdr)}, {rc_state, rc_state_len}, {paths, paths_len}};
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd >= 0) {
+        ssize_t total = sizeof(hdr) + rc_state_len + paths_len;
+        if (writev(fd, iov, 3) != total || close(fd) < 0 || rename(tmp, path) < 0) {
+            unlink(tmp);
+        }
+    }
+    free(paths);
+    free(stamp);
+    path_cache_dirty = 0;
+}
+
+// Whether a recorded identity is still that of the rc file loaded at startup
+int same_rc_identity(dev_t dev, ino_t ino, off_t size, struct timespec mtime, struct timespec ctime) {
+    return dev == rc_stat.st_dev && ino == rc_stat.st_ino && size == rc_stat.st_size &&
+           mtime.tv_sec == rc_stat.st_mtim.tv_sec && mtime.tv_nsec == rc_stat.st_mtim.tv_nsec &&
+           ctime.tv_sec == rc_stat.st_ctim.tv_sec && ctime.tv_nsec == rc_stat.st_ctim.tv_nsec;
+}
+
+// Restore rc state and the PATH cache from a snapshot that matches the rc
+// file. The mapping stays in place as the rc state for later rewrites.
+int load_rc_snapshot() {
+    char path[MAX_LEN * 2];
+    if (rc_snapshot_path(path, sizeof(path)) < 0) {
+        return -1;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    // The snapshot sets exports and aliases, so it is only trusted when
+    // nobody but this user could have written it
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+        st.st_size < (off_t)sizeof(struct rc_snapshot)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    struct rc_snapshot *hdr = (struct rc_snapshot *)map;
+    char *state = map + sizeof(*hdr);
+    char *paths = state + hdr->state_len;
+    char *end = map + st.st_size;
+    if (hdr->magic != RC_SNAPSHOT_MAGIC ||
+        !same_rc_identity(hdr->rc_dev, hdr->rc_ino, hdr->rc_size, hdr->rc_mtime, hdr->rc_ctime) ||
+        sizeof(*hdr) + hdr->state_len + hdr->path_len != (size_t)st.st_size ||
+        (hdr->state_len && paths[-1] != '\0') || (hdr->path_len && end[-1] != '\0')) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // The tables are empty at startup and the snapshot holds no duplicates,
+    // so entries are appended without the lookup set_variable does
+    for (char *p = state; p < paths; ) {
+        char *kind = p;
+        char *name = kind + strlen(kind) + 1;
+        char *value = name + strlen(name) + 1;
+        if (value >= paths) {
+            break;
+        }
+        p = value + strlen(value) + 1;
+        if (kind[0] == 'e') {
+            setenv(name, value, 1);
+        } else if (kind[0] == 'a' && alias_count < MAX_ALIASES) {
+            aliases[alias_count].name = strdup(name);
+            aliases[alias_count].value = strdup(value);
+            aliases[alias_count].active = 0;
+            alias_count++;
+#ifndef NO_VARS
+        } else if (kind[0] != 'a' && var_count < MAX_VARS) {
+            vars[var_count].name = strdup(name);
+            vars[var_count].value = strdup(value);
+            vars[var_count].global = kind[0] == 'g';
+            var_count++;
+#endif
+        }
+    }
+    // A command added to or removed from a PATH directory since the cache
+    // was saved could change any resolution, so the whole cache is dropped
+    char *stamp = hdr->path_len ? paths + strlen(paths) + 1 : end;
+    char *current = stamp < end ? path_dir_stamp(paths) : NULL;
+    if (current && strcmp(current, stamp) == 0) {
+        flush_path_cache();
+        free(path_cache_env);
+        free(path_cache_stamp);
+        path_cache_env = strdup(paths);
+        path_cache_stamp = current;
+        current = NULL;
+        for (char *p = stamp + strlen(stamp) + 1; p < end && path_cache_count < MAX_CACHED_PATHS; ) {
+            char *name = p;
+            char *found = name + strlen(name) + 1;
+            if (found >= end) {
+                break;
+            }
+            p = found + strlen(found) + 1;
+            path_cache[path_cache_count].name = strdup(name);
+            path_cache[path_cache_count].path = strdup(found);
+            path_cache_count++;
+        }
+    } else if (current) {
+        path_cache_dirty = 1;
+    }
+    free(current);
+    rc_state = state;
+    rc_state_len = hdr->state_len;
+    return 0;
+}
+
+// Keep commands resolved during this session in the snapshot for next time
+void save_path_cache_on_exit() {
+    struct stat st;
+    char rc[MAX_LEN * 2];
+    if (getpid() != shell_pid || !rc_snapshot_ok || !path_cache_dirty) {
+        return;
+    }
+    if (rc_file_path(rc, sizeof(rc)) < 0 || stat(rc, &st) < 0 ||
+        !same_rc_identity(st.st_dev, st.st_ino, st.st_size, st.st_mtim, st.st_ctim)) {
+        return;
+    }
+    save_rc_snapshot();
+}
+
+// Load the rc file, from its snapshot when the file has not changed since
+// the snapshot was taken, otherwise by evaluating it line by line
+void load_rc() {
+    char rc[MAX_LEN * 2];
+    if (rc_file_path(rc, sizeof(rc)) < 0 || stat(rc, &rc_stat) < 0) {
+        return;
+    }
+    shell_pid = getpid();
+    atexit(save_path_cache_on_exit);
+    if (load_rc_snapshot() == 0) {
+        rc_snapshot_ok = 1;
+        return;
+    }
+
+    FILE *fp = fopen(rc, "r");
+    if (!fp) {
+        perror("cannot read rc file");
+        return;
+    }
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    int pure = 1;
+    rc_loading = 1;
+    while ((len = getline(&line, &cap, fp)) > 0) {
+        if (line[len - 1] == '\n') {
+            line[--len] = '\0';
+        }
+        char *start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+        if (!is_rc_statement(start)) {
+            pure = 0;
+        }
+        parse_and_execute(start);
+    }
+    rc_loading = 0;
+    free(line);
+    fclose(fp);
+    if (pure) {
+        capture_rc_state();
+        save_rc_snapshot();
+        rc_snapshot_ok = 1;
+    }
+}
+
+// Build the environment for a server request: the client's environment
+// plus every variable exported in this session
+void load_request_env(char **env, int envc) {
+    clearenv();
+    for (int i = 0; i < envc; i++) {
+        putenv(env[i]);
+    }
+#ifndef NO_VARS
+    for (int i = 0; i < var_count; i++) {
+        if (vars[i].global) {
+            setenv(vars[i].name, vars[i].value, 1);
+        }
+    }
+#endif
+}
+
+// Run one request message: "cwd\0cmdline\0env...\0" with stdin/stdout/stderr attached
+void handle_request(char *msg, size_t len, int *fds, char **server_env, int *saved_fds, int server_cwd) {
+    char *env[MAX_VARS * 10];
+    int envc = 0;
+    char *cwd = msg;
+    char *cmdline = cwd + strlen(cwd) + 1;
+    for (char *p = cmdline + strlen(cmdline) + 1; p < msg + len && envc < MAX_VARS * 10; p += strlen(p) + 1) {
+        env[envc++] = p;
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+        close(fds[i]);
+    }
+    last_status = 0;
+    memset(&last_usage, 0, sizeof(last_usage));
+    if (chdir(cwd) < 0) {
+        perror("cd failed");
+        last_status = 1;
+    } else {
+        load_request_env(env, envc);
+        char *line = strdup(cmdline);
+        if (strlen(line) > 0) {
+            parse_and_execute(line);
+        }
+        free(line);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i = 0; i < 3; i++) {
+        dup2(saved_fds[i], i);
+    }
+    fchdir(server_cwd);
+    clearenv();
+    for (int i = 0; server_env[i]; i++) {
+        putenv(server_env[i]);
+    }
+}
+
+void note_child_exit(int sig) {
+    (void)sig;
+}
+
+// Read one request from a client connection, run it and send the reply.
+// Returns -1 once the connection is finished.
+int serve_request(int conn, char *msg, char **server_env, int *saved_fds, int server_cwd) {
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = {msg, SERVER_MSG_SIZE - 1};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    ssize_t n = recvmsg(conn, &hdr, MSG_CMSG_CLOEXEC | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return 0;
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    msg[n] = '\0';
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+        fprintf(stderr, "server: request without stdio descriptors\n");
+        return -1;
+    }
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    handle_request(msg, n, fds, server_env, saved_fds, server_cwd);
+
+    struct server_reply reply;
+    reply.status = last_status;
+    reply.usage = last_usage;
+    send(conn, &reply, sizeof(reply), MSG_NOSIGNAL);
+    return 0;
+}
+
+// Serve command lines sent over a unix socket by --client or other tools
+// Fill in a unix socket address, refusing a path sun_path cannot hold
+int socket_address(struct sockaddr_un *addr, char *sock_path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sock_path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Error: socket path too long (max %zu bytes): %s\n", sizeof(addr->sun_path) - 1, sock_path);
+        return -1;
+    }
+    strcpy(addr->sun_path, sock_path);
+    return 0;
+}
+
+// Make the socket path free for bind(): only a socket nobody listens on any
+// more is removed, never a regular file or another running server's socket
+int claim_socket_path(struct sockaddr_un *addr) {
+    struct stat st;
+    if (lstat(addr->sun_path, &st) < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        perror("cannot stat socket path");
+        return -1;
+    }
+    if (!S_ISSOCK(st.st_mode)) {
+        fprintf(stderr, "Error: %s exists and is not a socket\n", addr->sun_path);
+        return -1;
+    }
+    int probe = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (probe < 0) {
+        perror("socket failed");
+        return -1;
+    }
+    int rc = connect(probe, (struct sockaddr *)addr, sizeof(*addr));
+    int err = errno;
+    close(probe);
+    if (rc == 0) {
+        fprintf(stderr, "Error: a server is already running on %s\n", addr->sun_path);
+        return -1;
+    }
+    if (err != ECONNREFUSED) {
+        fprintf(stderr, "Error: cannot check %s: %s\n", addr->sun_path, strerror(err));
+        return -1;
+    }
+    if (unlink(addr->sun_path) < 0) {
+        perror("cannot remove stale socket");
+        return -1;
+    }
+    return 0;
+}
+
+int run_server(char *sock_path) {
+    struct sockaddr_un addr;
+    if (socket_address(&addr, sock_path) < 0 || claim_socket_path(&addr) < 0) {
+        return 1;
+    }
+
+    extern char **environ;
+    int env_count = 0;
+    while (environ[env_count]) env_count++;
+    char **server_env = malloc(sizeof(char *) * (env_count + 1));
+    for (int i = 0; i < env_count; i++) {
+        server_env[i] = strdup(environ[i]);
+    }
+    server_env[env_count] = NULL;
+
+    int saved_fds[3];
+    for (int i = 0; i < 3; i++) {
+        saved_fds[i] = fcntl(i, F_DUPFD_CLOEXEC, 3);
+    }
+    int server_cwd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 16) < 0) {
+        perror("server socket failed");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    server_mode = 1;
+    fprintf(stderr, "Serving on %s\n", sock_path);
+
+    // SIGCHLD only has to interrupt poll() so finished jobs are reaped
+    // promptly; SA_RESTART keeps the foreground wait4() uninterrupted
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = note_child_exit;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // Every connection is polled, so an idle client does not hold up the
+    // others; requests still run one at a time against the shared state
+    struct pollfd pfds[MAX_CLIENTS + 1];
+    int nclients = 0;
+    pfds[0].fd = listen_fd;
+    pfds[0].events = POLLIN;
+    char *msg = malloc(SERVER_MSG_SIZE);
+    for (;;) {
+#ifndef NO_JOBS
+        reap_background_jobs();
+#endif
+        if (poll(pfds, nclients + 1, -1) < 0) {
+            if (errno != EINTR) perror("poll failed");
+            continue;
+        }
+        for (int i = nclients; i >= 1; i--) {
+            if (pfds[i].revents && serve_request(pfds[i].fd, msg, server_env, saved_fds, server_cwd) < 0) {
+                close(pfds[i].fd);
+                pfds[i] = pfds[nclients--];
+            }
+        }
+        if (pfds[0].revents & POLLIN) {
+            int conn = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (conn < 0) {
+                if (errno != EINTR) perror("accept failed");
+            } else if (nclients == MAX_CLIENTS) {
+                fprintf(stderr, "server: too many clients\n");
+                close(conn);
+            } else {
+                nclients++;
+                pfds[nclients].fd = conn;
+                pfds[nclients].events = POLLIN;
+                pfds[nclients].revents = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+// Send one command line to a --server instance with our cwd, env and stdio
+int run_client(char *sock_path, int argc, char *argv[]) {
+    extern char **environ;
+    char *msg = malloc(SERVER_MSG_SIZE);
+    size_t len = 0;
+    if (!getcwd(msg, MAX_LEN * 2)) {
+        perror("getcwd failed");
+        return 1;
+    }
+    len = strlen(msg) + 1;
+    for (int i = 0; i < argc; i++) {
+        len += snprintf(msg + len, SERVER_MSG_SIZE - len, i ? " %s" : "%s", argv[i]);
+    }
+    len++;
+    for (char **e = environ; *e && len + strlen(*e) + 1 < SERVER_MSG_SIZE; e++) {
+        strcpy(msg + len, *e);
+        len += strlen(*e) + 1;
+    }
+
+    struct sockaddr_un addr;
+    if (socket_address(&addr, sock_path) < 0) {
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("connect failed");
+        return 1;
+    }
+
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = {msg, len};
+    struct msghdr hdr = {0};
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    struct server_reply reply;
+    if (sendmsg(fd, &hdr, 0) < 0 || recv(fd, &reply, sizeof(reply), 0) != sizeof(reply)) {
+        perror("request failed");
+        return 1;
+    }
+    if (getenv("SHELL_CLIENT_RUSAGE")) {
+        fprintf(stderr, "status %d, user %ld.%06lds, sys %ld.%06lds, maxrss %ldKB\n", reply.status,
+                reply.usage.ru_utime.tv_sec, reply.usage.ru_utime.tv_usec,
+                reply.usage.ru_stime.tv_sec, reply.usage.ru_stime.tv_usec, reply.usage.ru_maxrss);
+    }
+    return reply.status;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 3 && strcmp(argv[1], "--client") == 0) {
+        return run_client(argv[2], argc - 3, argv + 3);
+    }
+    load_rc();
+    if (argc > 2 && strcmp(argv[1], "--server") == 0) {
+        return run_server(argv[2]);
+    }
+
     char *cmdline;
 
-    while ((cmdline = readline(PROMPT)) != NULL) {
+    while ((cmdline = read_command_line(PROMPT)) != NULL) {
+#ifndef NO_JOBS
+        reap_background_jobs();
+#endif
         if (strlen(cmdline) > 0) {
-            add_history(cmdline);
             parse_and_execute(cmdline);
         }
         free(cmdline);